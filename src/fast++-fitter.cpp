@@ -1,11 +1,116 @@
 #include "fast++.hpp"
 #include <vif/utility/thread.hpp>
 
+struct fitter_t::workspace_t {
+    // Galaxy tile, stored filter-major so the kernel vectorizes across galaxies
+    vec2d flux;                  // [nflux,ntile]
+    vec2d edata;                 // [nflux,ntile] eflux^2 with template error, 1/eflux otherwise
+    vec1d lir_weight;            // [ntile]
+    vec1d lir_wflux;             // [ntile]
+
+    // Partial sums for each model of the batch and each galaxy of the tile
+    // NB: 's' prefix is for auto-scaled spectral data
+    // NB: only grown when a larger batch is fit, see reserve()
+    uint_t nmodel = 0;
+    vec2d wfm, wmm, wff;         // [nmodel,ntile]
+    vec2d swfm, swmm, swff;      // [nmodel,ntile]
+    vec1b fitted;                // [nmodel]
+    vec2b pruned;                // [nmodel,ntile]
+    vec1d prune_wf, prune_wm;    // [nflux] weighted fluxes and model in the screening bands
+
+    // Per source, for simulations
+    vec1d wflux, wmodel;         // [nflux+1]
+    vec1d mc_wfm, mc_swfm;       // [nsim] model-dependent part of sum(wmodel*rflux)
+    vec1f mc_chi2;               // [nsim]
+    vec2f mc_props;              // [nprop,nsim]
+
+    // Per source of the tile, for simulations: sum(rflux^2), which does not depend on the model
+    // NB: only used if they could not be pre-computed, see weight_store_t
+    // NB: only depends on redshift if a template error function is used, see 'mc_izs'
+    vec2d mc_rff, mc_srff;       // [ntile,nsim]
+    vec1u mc_izs;                // [ntile]
+
+    // Per model, for all sources of the tile
+    vec1b dofit;                 // [ntile]
+    // Per model, for all sources of the tile that are kept (first 'nkept' elements)
+    uint_t nkept = 0;
+    vec1u ids;                   // [ntile]
+    vec1f chi2;                  // [ntile]
+    vec2f props;                 // [ntile,nprop]
+
+    workspace_t(uint_t ntile, uint_t nflux, uint_t nprop, uint_t nsim) {
+        flux.resize(nflux, ntile);
+        edata.resize(nflux, ntile);
+        lir_weight.resize(ntile);
+        lir_wflux.resize(ntile);
+
+        prune_wf.resize(nflux);
+        prune_wm.resize(nflux);
+
+        if (nsim > 0) {
+            wflux.resize(nflux+1);
+            wmodel.resize(nflux+1);
+            mc_wfm.resize(nsim);
+            mc_swfm.resize(nsim);
+            mc_chi2.resize(nsim);
+            mc_props.resize(nprop, nsim);
+            mc_rff.resize(ntile, nsim);
+            mc_srff.resize(ntile, nsim);
+            mc_izs.resize(ntile);
+        }
+
+        dofit.resize(ntile);
+        ids.resize(ntile);
+        chi2.resize(ntile);
+        props.resize(ntile, nprop);
+    }
+
+    void reserve(uint_t nm) {
+        if (nm <= nmodel) return;
+
+        const uint_t ntile = flux.dims[1];
+        nmodel = nm;
+        wfm.resize(nmodel, ntile);
+        wmm.resize(nmodel, ntile);
+        wff.resize(nmodel, ntile);
+        swfm.resize(nmodel, ntile);
+        swmm.resize(nmodel, ntile);
+        swff.resize(nmodel, ntile);
+        fitted.resize(nmodel);
+        pruned.resize(nmodel, ntile);
+    }
+};
+
+// Sum of the squared perturbed fluxes rflux = wflux + sim_rnd for simulations [sim0,sim1),
+// split between the data in [0,mscale) and the auto-scaled spectral data in [mscale,ndata)
+inline void sum_sim_rff(const vec2d& sim_rnd, const double* wflux, uint_t mscale, uint_t ndata,
+    uint_t sim0, uint_t sim1, double* rff, double* srff) {
+
+    for (uint_t im = sim0; im < sim1; ++im) {
+        // In weighted units, the random perturbations have a sigma of unity
+        const double* rnd = &sim_rnd.safe(im,0);
+        double trff = 0.0, tsrff = 0.0;
+        for (uint_t il = 0; il < mscale; ++il) {
+            trff += sqr(wflux[il] + rnd[il]);
+        }
+        for (uint_t il = mscale; il < ndata; ++il) {
+            tsrff += sqr(wflux[il] + rnd[il]);
+        }
+
+        rff[im] = trff;
+        srff[im] = tsrff;
+    }
+}
+
+fitter_t::~fitter_t() {}
+
 fitter_t::fitter_t(const options_t& opt, const input_state_t& inp, const gridder_t& gri,
     output_state_t& out) : opts(opt), input(inp), gridder(gri), output(out) {
 
     vec1f& output_z = output.grid[grid_id::z];
 
+    nfit_models = 0;
+
     // Pre-compute template error
     if (!opts.temp_err_file.empty()) {
         if (opts.verbose) note("initializing template error function...");
@@ -108,31 +213,296 @@ fitter_t::fitter_t(const options_t& opt, const input_state_t& inp, const gridder
         }
     }
 
+    // Build redshift index
+    {
+        if (opts.verbose) note("building redshift index...");
+
+        const uint_t ngal = input.id.size();
+        const uint_t nz = output_z.size();
+
+        // Find redshift interval that can be explored by each galaxy
+        vec1u zl = idzl, zu = idzu;
+        if (opts.best_at_zphot) {
+            for (uint_t is : range(ngal)) {
+                if (idz.safe[is] != npos || idzp.safe[is] == npos) continue;
+
+                if (opts.n_sim == 0) {
+                    // Only the photo-z will be fit
+                    zl.safe[is] = zu.safe[is] = idzp.safe[is];
+                } else {
+                    // Simulations need the whole interval, and the photo-z
+                    zl.safe[is] = min(zl.safe[is], idzp.safe[is]);
+                    zu.safe[is] = max(zu.safe[is], idzp.safe[is]);
+                }
+            }
+        }
+
+        // Sort galaxies by interval
+        gorder = uindgen(ngal);
+        std::stable_sort(gorder.data.begin(), gorder.data.end(), [&](uint_t i, uint_t j) {
+            return zl.safe[i] < zl.safe[j] || (zl.safe[i] == zl.safe[j] && zu.safe[i] < zu.safe[j]);
+        });
+
+        // For each redshift, find runs of consecutive galaxies to fit
+        zrun_begin.resize(nz);
+        zrun_end.resize(nz);
+        uint_t nrun = 0;
+        for (uint_t p : range(ngal)) {
+            uint_t is = gorder.safe[p];
+            for (uint_t iz : range(zl.safe[is], zu.safe[is]+1)) {
+                vec1u& rb = zrun_begin.safe[iz];
+                vec1u& re = zrun_end.safe[iz];
+                if (!re.empty() && re.back() == p) {
+                    re.back() = p+1;
+                } else {
+                    rb.push_back(p);
+                    re.push_back(p+1);
+                    ++nrun;
+                }
+            }
+        }
+
+        if (opts.verbose) {
+            note("redshift index contains ", nrun, " runs (size ",
+                pretty_size(2.0*nrun*sizeof(uint_t) + ngal*sizeof(uint_t)), ")");
+        }
+    }
+
     // Pre-generate random fluctuations
     if (opts.n_sim > 0) {
         auto seed = make_seed(42);
         sim_rnd = randomn(seed, opts.n_sim, input.lambda.size()+1);
     }
 
+    // Pre-compute weights and weighted fluxes
+    {
+        const uint_t ngal = input.id.size();
+        const uint_t nflux = input.lambda.size();
+        const bool use_tplerr = !opts.temp_err_file.empty();
+        const uint_t nscale = (opts.auto_scale ? input.spec_start : nflux);
+
+        wstore.zdep = use_tplerr;
+        const uint_t nzs = (wstore.zdep ? output_z.size() : 1);
+
+        double expsize = double(nzs)*ngal*(2*nflux + 2)*sizeof(double);
+        use_wstore = expsize <= 1024.0*1024.0*opts.max_weight_store;
+
+        // Sum of the squared perturbed fluxes of each simulation, if there is room left
+        double simsize = double(nzs)*ngal*2*opts.n_sim*sizeof(double);
+        wstore.sims = use_wstore && opts.n_sim > 0 &&
+            expsize + simsize <= 1024.0*1024.0*opts.max_weight_store;
+        if (wstore.sims) {
+            expsize += simsize;
+        }
+
+        if (use_wstore) {
+            if (opts.verbose) {
+                note("pre-computing weighted fluxes... (size ", pretty_size(expsize), ")");
+            }
+
+            wstore.weight.resize(nzs, nflux, ngal);
+            wstore.wflux.resize(nzs, nflux, ngal);
+            wstore.wff.resize(nzs, ngal);
+            wstore.swff.resize(nzs, ngal);
+
+            for (uint_t izs : range(nzs))
+            for (uint_t il : range(nflux))
+            for (uint_t ip : range(ngal)) {
+                uint_t is = gorder.safe[ip];
+                double w = (use_tplerr && il < nscale ?
+                    1.0/sqrt(sqr(input.eflux.safe(is,il)) +
+                        tpl_err.safe(izs,il)*sqr(input.flux.safe(is,il))) :
+                    1.0/input.eflux.safe(is,il)
+                );
+
+                double wf = input.flux.safe(is,il)*w;
+                wstore.weight.safe(izs,il,ip) = w;
+                wstore.wflux.safe(izs,il,ip) = wf;
+
+                if (il < nscale) {
+                    wstore.wff.safe(izs,ip) += sqr(wf);
+                } else {
+                    wstore.swff.safe(izs,ip) += sqr(wf);
+                }
+            }
+
+            if (wstore.sims) {
+                const bool has_lir = !input.lir.empty();
+
+                wstore.rff.resize(nzs, ngal, opts.n_sim);
+                wstore.srff.resize(nzs, ngal, opts.n_sim);
+
+                vec1d wflux(nflux+1);
+                for (uint_t izs : range(nzs))
+                for (uint_t ip : range(ngal)) {
+                    uint_t is = gorder.safe[ip];
+
+                    // Same layout as in fit_galaxies(): LIR first, if any
+                    uint_t iflx = 0;
+                    if (has_lir && is_finite(input.lir.safe[is])) {
+                        wflux.safe[0] = input.lir.safe[is]/input.lir_err.safe[is];
+                        ++iflx;
+                    }
+
+                    for (uint_t il : range(nflux)) {
+                        wflux.safe[il+iflx] = wstore.wflux.safe(izs,il,ip);
+                    }
+
+                    uint_t mscale = (opts.auto_scale && has_spec.safe[is] ? nscale : nflux) + iflx;
+                    sum_sim_rff(sim_rnd, wflux.data.data(), mscale, nflux + iflx, 0, opts.n_sim,
+                        &wstore.rff.safe(izs,ip,0), &wstore.srff.safe(izs,ip,0));
+                }
+            }
+        } else if (opts.verbose) {
+            note("weighted fluxes would use ", pretty_size(expsize), " of memory (more than "
+                "MAX_WEIGHT_STORE), they will be computed on the fly");
+        }
+    }
+
+    // Initialize best fits for each worker thread
+    {
+        const uint_t ngal = input.id.size();
+        const uint_t nprop = gridder.nprop;
+
+        // When fitting in parallel over the models, each thread finds its own best fits;
+        // when fitting in parallel over sources, each galaxy is always fit by the same thread
+        uint_t nslot = 1;
+        if (opts.parallel == parallel_choice::models || opts.parallel == parallel_choice::generators) {
+            nslot = opts.n_thread;
+        }
+
+        if (opts.verbose && nslot > 1) {
+            double expsize = nslot*double(ngal)*(3 + nprop + opts.n_sim*(2 + nprop))*sizeof(float);
+            note("initializing best fits for each thread... (size ", pretty_size(expsize), ")");
+        }
+
+        best_fits.resize(nslot);
+        for (auto& best : best_fits) {
+            best.chi2 = replicate(finf, ngal);
+            best.model = replicate(npos, ngal);
+            best.props = replicate(fnan, ngal, nprop);
+            best.num_models = replicate(0, ngal);
+
+            if (opts.n_sim > 0) {
+                best.mc_chi2 = replicate(finf, ngal, opts.n_sim);
+                best.mc_model = replicate(npos, ngal, opts.n_sim);
+                best.mc_props = replicate(fnan, ngal, nprop, opts.n_sim);
+            }
+
+            if (opts.coarse_grid_step > 1) {
+                uint_t ntop = max(opts.coarse_grid_nbest, uint_t(1));
+                best.top_chi2 = replicate(finf, ngal, ntop);
+                best.top_model = replicate(npos, ngal, ntop);
+            }
+        }
+    }
+
+    if (opts.coarse_grid_step > 1 && opts.save_chi_grid) {
+        warning("with COARSE_GRID_STEP, the chi2 grid will only contain the models that "
+            "were evaluated");
+    }
+
+    // Prepare screening of models
+    if (opts.prune_bands > 0) {
+        if (opts.save_chi_grid) {
+            warning("PRUNE_BANDS is not compatible with SAVE_CHI_GRID and is disabled");
+        } else if (!use_wstore) {
+            warning("PRUNE_BANDS requires pre-computed weights and is disabled (increase "
+                "MAX_WEIGHT_STORE)");
+        } else {
+            use_pruning = true;
+        }
+    }
+
+    if (use_pruning) {
+        if (opts.verbose) note("selecting bands for model screening...");
+
+        const uint_t ngal = input.id.size();
+        const uint_t nscale = (opts.auto_scale ? input.spec_start : input.lambda.size());
+        const uint_t nprune = min(opts.prune_bands, nscale);
+
+        // Models whose chi2 may fall within SAVE_BESTCHI of the best fit must still be computed
+        prune_tol = (opts.save_bestchi > 0 ? opts.save_bestchi : 0.0);
+
+        // For each galaxy, use the bands with the highest S/N
+        prune_ids = replicate(npos, ngal, nprune);
+        for (uint_t ip : range(ngal)) {
+            uint_t is = gorder.safe[ip];
+
+            vec1d sn = replicate(-dinf, nscale);
+            for (uint_t il : range(nscale)) {
+                double e = input.eflux.safe(is,il);
+                if (is_finite(e) && e > 0) {
+                    sn.safe[il] = input.flux.safe(is,il)/e;
+                }
+            }
+
+            vec1u ids = sort(-sn);
+            for (uint_t ib : range(nprune)) {
+                if (!is_finite(sn.safe[ids.safe[ib]])) break;
+                prune_ids.safe(ip,ib) = ids.safe[ib];
+            }
+        }
+
+        // Generate first the models close to the redshifts of most galaxies, so that the best
+        // chi2 of each galaxy decreases quickly and more models can be skipped
+        const uint_t nz = output_z.size();
+        vec1u zcount(nz);
+        for (uint_t is : range(input.id)) {
+            if (idzp.safe[is] != npos) {
+                ++zcount.safe[idzp.safe[is]];
+            }
+        }
+
+        if (total(zcount) > 0) {
+            vec1d zdist(nz);
+            for (uint_t iz : range(nz)) {
+                // Distance to the closest galaxy redshift
+                zdist.safe[iz] = dinf;
+                for (uint_t jz : range(nz)) {
+                    if (zcount.safe[jz] == 0) continue;
+                    zdist.safe[iz] = min(zdist.safe[iz], abs(double(iz) - double(jz)) -
+                        zcount.safe[jz]/double(input.id.size()));
+                }
+            }
+
+            model_zorder = sort(zdist);
+        }
+
+        if (opts.verbose) {
+            note("models will be screened using the ", nprune, " bands with the highest S/N");
+        }
+    }
+
+    // Choose the block sizes of the fit kernel: galaxies are processed in tiles small enough
+    // that their data stays in the L2 cache while a whole batch of models is fit to them
+    {
+        const uint_t l2_size = 256*1024;
+        tile_size = l2_size/(2*sizeof(double)*(input.lambda.size()+1));
+        tile_size = min(max(tile_size, uint_t(8)), uint_t(4096));
+        batch_size = 16;
+    }
+
+    // Initialize the fit workspace of each thread
+    // NB: they are kept between calls, so that fitting a model does not allocate memory
+    {
+        uint_t nslot = (opts.parallel == parallel_choice::none ? 1 : opts.n_thread);
+        workspaces.resize(nslot);
+        for (auto& wsp : workspaces) {
+            wsp.reset(new workspace_t(tile_size, input.lambda.size(), gridder.nprop, opts.n_sim));
+            wsp->reserve(batch_size);
+        }
+    }
+
     // Initialize chi2 grid if asked
     save_chi2 = opts.save_chi_grid || opts.save_bestchi > 0;
 
     if (opts.save_chi_grid) {
         // Create chi2 grid on disk
+        // NB: only models which can be fit are stored
         if (opts.verbose) {
-            double expsize = input.id.size()*double(gridder.nmodel)*(1+gridder.nprop)*sizeof(float);
-
-            std::string unit = "B";
-            vec1s units = vec1s{"k", "M", "G", "T", "P"}+"B";
-            for (uint_t i : range(units)) {
-                if (expsize > 1024) {
-                    expsize /= 1024;
-                    unit = units[i];
-                } else {
-                    break;
-                }
-            }
-            note("initializing chi2 grid on disk... (expected size ", expsize, " ", unit, ")");
+            double expsize = input.id.size()*double(gridder.nvalid)*(1+gridder.nprop)*sizeof(float);
+            note("initializing chi2 grid on disk... (expected size ", pretty_size(expsize), ")");
         }
 
         ochi2.out_filename = opts.output_dir+"chi2.grid";
@@ -151,6 +521,8 @@ fitter_t::fitter_t(const options_t& opt, const input_state_t& inp, const gridder
         //     char[*]: name
         //     uint32: number of values
         //     float[*]: grid values
+        // uint32: number of models stored in the file
+        // uint8[*]: bit mask of models stored in the file (ceil(nmodel/8) bytes)
         const unsigned char ftype_chi2grid = 'C';
         file::write_as<std::uint32_t>(ochi2.out_file, 0);
         file::write(ochi2.out_file, ftype_chi2grid);
@@ -168,6 +540,17 @@ fitter_t::fitter_t(const options_t& opt, const input_state_t& inp, const gridder
             file::write(ochi2.out_file, output.grid[i]);
         }
 
+        // NB: the position of a model in the file is its rank in gridder.model_valid
+        file::write_as<std::uint32_t>(ochi2.out_file, gridder.nvalid);
+        vec<1,std::uint8_t> valid_bits = replicate(std::uint8_t(0), (gridder.nmodel+7)/8);
+        for (uint_t igrid : range(gridder.nmodel)) {
+            if (gridder.model_valid.get(igrid)) {
+                valid_bits.safe[igrid/8] |= std::uint8_t(1) << (igrid % 8);
+            }
+        }
+
+        file::write(ochi2.out_file, valid_bits);
+
         ochi2.hpos = ochi2.out_file.tellp();
 
         ochi2.out_file.seekp(0);
@@ -176,11 +559,24 @@ fitter_t::fitter_t(const options_t& opt, const input_state_t& inp, const gridder
 
         // Populate the file with empty data now
         // For each point of the grid, we store chi2 and properties
-        uint_t nmodel1 = gridder.nmodel;
-        uint_t idm = max_id(gridder.grid_dims);
-        nmodel1 /= gridder.grid_dims[idm];
-        vec1f chunk = replicate(fnan, gridder.grid_dims[idm]*input.id.size()*(1+gridder.nprop));
-        for (uint_t im = 0; im < nmodel1; ++im) {
+        // NB: models which are not fit (see COARSE_GRID_STEP) keep an infinite chi2, so they
+        // can be told apart from models with invalid fits (NaN)
+        const uint_t ngal = input.id.size();
+        uint_t nchunk_model = max(gridder.grid_dims);
+        vec1f chunk = replicate(fnan, nchunk_model*ngal*(1+gridder.nprop));
+        for (uint_t im : range(nchunk_model)) {
+            uint_t i0 = im*ngal*(1+gridder.nprop);
+            for (uint_t is : range(ngal)) {
+                chunk.safe[i0+is] = finf;
+            }
+        }
+
+        for (uint_t im = 0; im < gridder.nvalid; im += nchunk_model) {
+            if (im + nchunk_model > gridder.nvalid) {
+                // Last chunk
+                chunk.resize((gridder.nvalid - im)*ngal*(1+gridder.nprop));
+            }
+
             if (!file::write(ochi2.out_file, chunk)) {
                 warning("the chi2 grid could not be initialized");
                 ochi2.out_file.close();
@@ -259,7 +655,8 @@ fitter_t::fitter_t(const options_t& opt, const input_state_t& inp, const gridder
         workers_multi_model = std::unique_ptr<workers_multi_model_t>(
             new workers_multi_model_t(*this)
         );
-    } else if (opts.parallel == parallel_choice::sources) {
+    } else if (opts.parallel == parallel_choice::sources ||
+        opts.parallel == parallel_choice::simulations) {
         workers_multi_source = std::unique_ptr<workers_multi_source_t>(
             new workers_multi_source_t(*this)
         );
@@ -268,47 +665,54 @@ fitter_t::fitter_t(const options_t& opt, const input_state_t& inp, const gridder
 
 fitter_t::workers_multi_source_t::workers_multi_source_t(fitter_t& f) : fitter(f) {
     workers.start(fitter.opts.n_thread, [this](const model_source_pair& p) {
-        fitter.fit_galaxies(p.model, p.i0, p.i1);
+        fitter.fit_galaxies(p.models->views.data.data(), p.models->size, p.ipart, p.npart);
     });
-}
 
-void fitter_t::workers_multi_source_t::process(const model_t& model) {
-    while (fitter.opts.max_queued_fits > 0 && workers.remaining() > fitter.opts.max_queued_fits) {
-        thread::sleep_for(1e-6);
+    if (fitter.opts.max_queued_fits > 0) {
+        workers.set_max_queued(max(fitter.opts.max_queued_fits/fitter.batch_size, uint_t(1)));
     }
+}
 
-    uint_t i0 = 0;
-    uint_t dn = fitter.input.id.size()/fitter.opts.n_thread;
+void fitter_t::workers_multi_source_t::process(model_batch models) {
+    // The batch is shared by all workers, and recycled when the last one is done with it
+    fitter_t& tfitter = fitter;
+    std::shared_ptr<const model_batch> shared(new model_batch(std::move(models)),
+        [&tfitter](model_batch* b) {
+            tfitter.recycle_batch(std::move(*b));
+            delete b;
+        });
+
+    // Each worker always gets the same share of the galaxies (or simulations), see fit_galaxies()
     for (uint_t iw : range(fitter.opts.n_thread)) {
-        uint_t i1 = (iw == fitter.opts.n_thread-1 ? fitter.input.id.size() : i0 + dn);
-        workers.process(iw, model_source_pair(model, i0, i1));
-        i0 = i1;
+        workers.process(iw, model_source_pair(shared, iw, fitter.opts.n_thread));
     }
 }
 
 fitter_t::workers_multi_model_t::workers_multi_model_t(fitter_t& f) : fitter(f) {
-    workers.start(fitter.opts.n_thread, [this](const model_t& model) {
-        fitter.fit_galaxies(model, 0, fitter.input.id.size());
+    workers.start(fitter.opts.n_thread, [this](model_batch& models) {
+        fitter.fit_galaxies(models.views.data.data(), models.size, 0, 1);
+        fitter.recycle_batch(std::move(models));
     });
-}
 
-void fitter_t::workers_multi_model_t::process(const model_t& model) {
-    while (fitter.opts.max_queued_fits > 0 && workers.remaining() > fitter.opts.max_queued_fits) {
-        thread::sleep_for(1e-6);
+    if (fitter.opts.max_queued_fits > 0) {
+        workers.set_max_queued(max(fitter.opts.max_queued_fits/fitter.batch_size, uint_t(1)));
     }
+}
 
-    workers.process(model);
+void fitter_t::workers_multi_model_t::process(model_batch models) {
+    workers.process(std::move(models));
 }
 
-void fitter_t::write_chi2(uint_t igrid, const vec1f& chi2, const vec2f& props, uint_t i0) {
+void fitter_t::write_chi2(uint_t igrid, const vec1u& ids, const vec1f& chi2, const vec2f& props,
+    uint_t n) {
     // TODO: consider putting this in a worker thread if this is slowing down too much
 
     if (opts.save_bestchi > 0) {
         std::ofstream out;
         std::ifstream in;
 
-        for (uint_t cis : range(chi2)) {
-            uint_t is = cis + i0;
+        for (uint_t cis : range(n)) {
+            uint_t is = ids.safe[cis];
 
             if (chi2.safe[cis] > best_chi2.safe[is] + opts.save_bestchi) continue;
 
@@ -360,92 +764,98 @@ void fitter_t::write_chi2(uint_t igrid, const vec1f& chi2, const vec2f& props, u
     }
 
     if (opts.save_chi_grid) {
-        auto p0 = ochi2.hpos + igrid*input.id.size()*(1+gridder.nprop)*sizeof(float);
+        auto p0 = ochi2.hpos + gridder.model_valid.rank(igrid)*input.id.size()*(1+gridder.nprop)*sizeof(float);
+
+        // Write runs of consecutive galaxies in one go
+        uint_t j0 = 0;
+        while (j0 < n) {
+            uint_t j1 = j0+1;
+            while (j1 < n && ids.safe[j1] == ids.safe[j1-1]+1) {
+                ++j1;
+            }
 
-        ochi2.out_file.seekp(p0 + i0*sizeof(float));
-        file::write(ochi2.out_file, chi2);
+            uint_t i0 = ids.safe[j0];
 
-        for (uint_t p : range(gridder.nprop)) {
-            ochi2.out_file.seekp(p0 + ((1+p)*input.id.size() + i0)*sizeof(float));
-            file::write(ochi2.out_file, vec1f(props.safe(_,p)));
-        }
-    }
-}
+            ochi2.out_file.seekp(p0 + i0*sizeof(float));
+            file::write(ochi2.out_file, vec1f(chi2[j0-_-(j1-1)]));
 
-struct fitter_workspace {
-    // Loop local, per source
-    char*   pool     = nullptr;
-    double* weight   = nullptr;
-    double* wflux    = nullptr;
-    double* wmodel   = nullptr;
-    double* rflux    = nullptr;
-    vec1f  mc_chi2;
-    vec2f  mc_props;
-
-    // For all sources
-    vec1f chi2;
-    vec2f props;
-
-    fitter_workspace(uint_t ngal, uint_t nflux, uint_t nprop, uint_t nsim) {
-        uint_t buffer_size = sizeof(double)*nflux*(3 + (nsim > 0 ? 1 : 0));
-        pool = new char[buffer_size];
-
-        std::ptrdiff_t off = 0;
-        weight = reinterpret_cast<double*>(pool + off); off += nflux*sizeof(double);
-        wflux  = reinterpret_cast<double*>(pool + off); off += nflux*sizeof(double);
-        wmodel = reinterpret_cast<double*>(pool + off); off += nflux*sizeof(double);
+            for (uint_t p : range(gridder.nprop)) {
+                ochi2.out_file.seekp(p0 + ((1+p)*input.id.size() + i0)*sizeof(float));
+                file::write(ochi2.out_file, vec1f(props(j0-_-(j1-1),p)));
+            }
 
-        if (nsim > 0) {
-            rflux = reinterpret_cast<double*>(pool + off); off += nflux*sizeof(double);
+            j0 = j1;
         }
-
-        vif_check(uint_t(off) == buffer_size, "mismatch in buffer and arrays, please report!");
-
-        mc_chi2.resize(nsim);
-        mc_props.resize(nprop, nsim);
-
-        chi2 = replicate(finf, ngal);
-        props = replicate(fnan, ngal, nprop);
     }
+}
 
-    fitter_workspace(const fitter_workspace&) = delete;
-    fitter_workspace(fitter_workspace&&) = delete;
-    fitter_workspace& operator=(const fitter_workspace&) = delete;
-    fitter_workspace& operator=(fitter_workspace&&) = delete;
-
-    ~fitter_workspace() {
-        delete pool;
-    }
-};
-
-void fitter_t::fit_galaxies(const model_t& model, uint_t i0, uint_t i1) {
-    fitter_workspace wsp(i1-i0, input.lambda.size()+1, model.props.size(), opts.n_sim);
-
-    uint_t iz = gridder.grid_ids(model.igrid)[grid_id::z];
+// Compare a fit to the current best fit; for equal chi2, the model with the lowest
+// grid index wins, so that the result does not depend on the order in which models are fit
+inline bool is_better_fit(float chi2, uint_t igrid, float best_chi2, uint_t best_igrid) {
+    return chi2 < best_chi2 || (chi2 == best_chi2 && best_igrid != npos && igrid < best_igrid);
+}
 
-    if (opts.debug) {
-        // DEBUG: check that model has all finite values
-        if (count(!is_finite(model.flux)) > 0) {
-            fits::write_table("debug.fits",
-                "flux", model.flux, "grid_id", gridder.grid_ids(model.igrid));
-            vif_check(false, "model has invalid values, saved in debug.fits for inspection");
-        }
-        // DEBUG: check that model is not only zero values
-        if (count(model.flux > 0.0) == 0) {
-            fits::write_table("debug.fits",
-                "flux", model.flux, "grid_id", gridder.grid_ids(model.igrid));
-            vif_check(false, "model has all zero values, saved in debug.fits for inspection");
+void fitter_t::fit_galaxies(const model_view_t* models, uint_t nm, uint_t ipart, uint_t npart) {
+    const uint_t nflux = input.lambda.size();
+    const uint_t nprop = gridder.nprop;
+    const bool use_tplerr = !opts.temp_err_file.empty();
+    const bool has_lir = !input.lir.empty();
+
+    // Fluxes in [0,nscale) share the same scaling, fluxes in [nscale,nflux) are spectral data
+    // which may be auto-scaled (and are then not affected by the template error)
+    const uint_t nscale = (opts.auto_scale ? input.spec_start : nflux);
+
+    // Workspace of this thread
+    workspace_t& wsp = *workspaces[workspaces.size() == 1 ? 0 : thread::this_worker_id()];
+    wsp.reserve(nm);
+
+    vec1u iz(nm);
+    for (uint_t k : range(nm)) {
+        const model_view_t& model = models[k];
+        iz.safe[k] = gridder.grid_ids(model.igrid)[grid_id::z];
+
+        if (opts.debug) {
+            vec1f flux(nflux);
+            std::copy(model.flux, model.flux + nflux, flux.data.begin());
+
+            // DEBUG: check that model has all finite values
+            if (count(!is_finite(flux)) > 0) {
+                fits::write_table("debug.fits",
+                    "flux", flux, "grid_id", gridder.grid_ids(model.igrid));
+                vif_check(false, "model has invalid values, saved in debug.fits for inspection");
+            }
+            // DEBUG: check that model is not only zero values
+            if (count(flux > 0.0) == 0) {
+                fits::write_table("debug.fits",
+                    "flux", flux, "grid_id", gridder.grid_ids(model.igrid));
+                vif_check(false, "model has all zero values, saved in debug.fits for inspection");
+            }
         }
     }
 
-    for (uint_t i : range(i1-i0)) {
-        uint_t is = i + i0;
+    // Best fits of this thread
+    best_fit_state_t& best = best_fits.safe[best_fits.size() == 1 ? 0 : thread::this_worker_id()];
+
+    // With PARALLEL='simulations', all the workers fit all the galaxies but each takes care of
+    // its own range of simulations; only the first one saves the fit to the observed fluxes
+    uint_t sim0 = 0, sim1 = opts.n_sim;
+    bool base_fit = true;
+    if (opts.parallel == parallel_choice::simulations) {
+        sim0 = (ipart*opts.n_sim)/npart;
+        sim1 = ((ipart+1)*opts.n_sim)/npart;
+        base_fit = (ipart == 0);
+        ipart = 0;
+        npart = 1;
+
+        if (!base_fit && sim0 == sim1) return;
+    }
 
-        // Apply constraints on redshift
-        bool dofit = (idzl.safe[is] <= iz && iz <= idzu.safe[is]);
-        bool keepfit = true;
+    // Apply constraints on redshift
+    auto fit_status = [&](uint_t is, uint_t tiz, bool& keepfit) {
+        bool dofit = (idzl.safe[is] <= tiz && tiz <= idzu.safe[is]);
+        keepfit = true;
         if (opts.best_at_zphot && idzp.safe[is] != npos) {
-            if (idzp.safe[is] == iz) {
+            if (idzp.safe[is] == tiz) {
                 dofit = true;
                 keepfit = true;
             } else {
@@ -456,230 +866,588 @@ void fitter_t::fit_galaxies(const model_t& model, uint_t i0, uint_t i1) {
             }
         }
 
-        if (!dofit) {
-            // Skip this model
-            continue;
+        return dofit;
+    };
+
+    // Gather the galaxies that can be fit by these models from the redshift index
+    // NB: these are positions in the sorted galaxy list, see 'gorder'
+    std::vector<std::pair<uint_t,uint_t>> zruns;
+    {
+        vec1u uz = iz;
+        inplace_sort(uz);
+        for (uint_t k : range(uz)) {
+            if (k > 0 && uz.safe[k] == uz.safe[k-1]) continue;
+
+            const vec1u& rb = zrun_begin.safe[uz.safe[k]];
+            const vec1u& re = zrun_end.safe[uz.safe[k]];
+            for (uint_t r : range(rb)) {
+                zruns.push_back(std::make_pair(rb.safe[r], re.safe[r]));
+            }
+        }
+
+        // Merge overlapping runs
+        std::sort(zruns.begin(), zruns.end());
+        uint_t nrun = 0;
+        for (uint_t r : range(zruns.size())) {
+            if (nrun > 0 && zruns[r].first <= zruns[nrun-1].second) {
+                zruns[nrun-1].second = max(zruns[nrun-1].second, zruns[r].second);
+            } else {
+                zruns[nrun] = zruns[r];
+                ++nrun;
+            }
         }
 
-        // Compute weights and scaling factor
-        double wfm = 0, wmm = 0;
-        uint_t ndata = input.lambda.size();
-        uint_t iflx = 0;
+        zruns.resize(nrun);
+    }
+
+    // Process these galaxies in tiles aligned on multiples of tile_size;
+    // when multiple workers share the galaxies, tiles are distributed in round-robin
+    for (const auto& run : zruns)
+    for (uint_t t = run.first/tile_size; t*tile_size < run.second; ++t) {
+        if (t % npart != ipart) continue;
+
+        const uint_t j0 = max(run.first, t*tile_size);
+        const uint_t j1 = min(run.second, (t+1)*tile_size);
+        const uint_t nt = j1 - j0;
+
+        if (!use_wstore) {
+            // Pack the galaxy data of this tile
+            for (uint_t il : range(nflux))
+            for (uint_t i : range(nt)) {
+                uint_t is = gorder.safe[i + j0];
+                double e = input.eflux.safe(is,il);
+                wsp.flux.safe(il,i) = input.flux.safe(is,il);
+                wsp.edata.safe(il,i) = (use_tplerr && il < nscale ? sqr(e) : 1.0/e);
+            }
+        }
 
-        uint_t nscale = ndata;
-        bool spec_auto_scale = opts.auto_scale && has_spec.safe[is];
-        if (spec_auto_scale) {
-            nscale -= input.spec_end - input.spec_start;
+        if (opts.n_sim > 0 && !wstore.sims) {
+            // Invalidate simulation data from previous tile
+            wsp.mc_izs[_] = npos;
         }
 
         // Add LIR as a data point in the fit
-        if (!input.lir.empty() && is_finite(input.lir.safe[is])) {
-            wsp.weight[0] = 1.0/input.lir_err.safe[is];
-            wsp.wflux[0] = input.lir.safe[is]*wsp.weight[0];
-            wsp.wmodel[0] = model.props.safe[prop_id::ldust]*wsp.weight[0];
+        for (uint_t i : range(nt)) {
+            uint_t is = gorder.safe[i + j0];
+            if (has_lir && is_finite(input.lir.safe[is])) {
+                wsp.lir_weight.safe[i] = 1.0/input.lir_err.safe[is];
+                wsp.lir_wflux.safe[i] = input.lir.safe[is]*wsp.lir_weight.safe[i];
+            } else {
+                wsp.lir_weight.safe[i] = 0.0;
+                wsp.lir_wflux.safe[i] = 0.0;
+            }
+        }
 
-            wfm += wsp.wmodel[0]*wsp.wflux[0];
-            wmm += sqr(wsp.wmodel[0]);
+        // Compute the weighted sums for all models and galaxies of the tile
+        for (uint_t k : range(nm)) {
+            const model_view_t& model = models[k];
 
-            ++ndata;
-            ++nscale;
-            ++iflx;
-        }
+            bool keepfit;
+            wsp.fitted.safe[k] = false;
+            for (uint_t i : range(nt)) {
+                if (fit_status(gorder.safe[i + j0], iz.safe[k], keepfit)) {
+                    wsp.fitted.safe[k] = true;
+                    break;
+                }
+            }
 
-        for (uint_t il : range(iflx, nscale)) {
-            wsp.weight[il] = (opts.temp_err_file.empty() ?
-                1.0/input.eflux.safe(is,il-iflx) :
-                1.0/sqrt((sqr(input.eflux.safe(is,il-iflx)) +
-                    tpl_err.safe(iz,il-iflx)*sqr(input.flux.safe(is,il-iflx))))
-            );
+            if (!wsp.fitted.safe[k]) {
+                // No galaxy to fit with this model
+                continue;
+            }
 
-            wsp.wflux[il] = input.flux.safe(is,il-iflx)*wsp.weight[il];
-            wsp.wmodel[il] = model.flux.safe[il-iflx]*wsp.weight[il];
+            if (use_pruning) {
+                // Screen model with a subset of the bands: the chi2 with the best scaling
+                // on this subset is a lower bound of the full chi2
+                // NB: keep a small margin to be safe against round-off errors
+                auto cannot_beat = [](double sff, double sfm, double smm, double bchi2) {
+                    double lchi2 = (smm > 0.0 ? sff - sfm*sfm/smm : sff);
+                    return lchi2*(1.0 - 1e-5) > bchi2 + 1e-5;
+                };
 
-            wfm += wsp.wmodel[il]*wsp.wflux[il];
-            wmm += sqr(wsp.wmodel[il]);
-        }
+                const uint_t izs = (wstore.zdep ? iz.safe[k] : 0);
+                bool survived = false;
+                for (uint_t i : range(nt)) {
+                    uint_t is = gorder.safe[i + j0];
+                    wsp.pruned.safe(k,i) = false;
+
+                    if (!fit_status(is, iz.safe[k], keepfit)) continue;
+
+                    uint_t nb = 0;
+                    double sff = 0.0, sfm = 0.0, smm = 0.0;
+                    for (uint_t ib : range(prune_ids.dims[1])) {
+                        uint_t il = prune_ids.safe(i + j0, ib);
+                        if (il == npos) break;
+
+                        double wf = wstore.wflux.safe(izs,il,i + j0);
+                        double wm = model.flux[il]*wstore.weight.safe(izs,il,i + j0);
+                        sff += wf*wf;
+                        sfm += wm*wf;
+                        smm += wm*wm;
+
+                        wsp.prune_wf.safe[nb] = wf;
+                        wsp.prune_wm.safe[nb] = wm;
+                        ++nb;
+                    }
 
-        double scale = wfm/wmm;
-        double spec_scale = scale;
+                    // The fit to the observed fluxes is needed if it is kept and may improve
+                    // the current best fit
+                    bool needed = false;
+                    if (base_fit && keepfit) {
+                        needed = !cannot_beat(sff, sfm, smm, best.chi2.safe[is] + prune_tol);
+                    }
+
+                    // Otherwise, the same bound is applied to each simulation, using the
+                    // perturbed fluxes rflux = wflux + sim_rnd (see below)
+                    if (!needed && opts.n_sim > 0) {
+                        const uint_t iflx = (has_lir && is_finite(input.lir.safe[is]) ? 1 : 0);
+                        for (uint_t im : range(sim0, sim1)) {
+                            const double* rnd = &sim_rnd.safe(im,iflx);
+                            double rff = 0.0, rfm = 0.0;
+                            for (uint_t ib = 0; ib < nb; ++ib) {
+                                double rf = wsp.prune_wf.safe[ib] + rnd[prune_ids.safe(i + j0, ib)];
+                                rff += rf*rf;
+                                rfm += wsp.prune_wm.safe[ib]*rf;
+                            }
+
+                            if (!cannot_beat(rff, rfm, smm, best.mc_chi2.safe(is,im))) {
+                                needed = true;
+                                break;
+                            }
+                        }
+                    }
 
-        // Auto scaling for spectral data
-        // When enabled, spectral data doesn't participate in the global normalization,
-        // just to the chi2. It is separately rescaled to match the model, which is equivalent
-        // to assuming we don't know the absolute flux calibration but we are confident on
-        // the shape of the spectrum.
-        double swfm = 0, swmm = 0;
-        if (spec_auto_scale) {
-            for (uint_t il : range(nscale, ndata)) {
-                wsp.weight[il] = 1.0/input.eflux.safe(is,il-iflx);
-                wsp.wflux[il] = input.flux.safe(is,il-iflx)*wsp.weight[il];
-                wsp.wmodel[il] = model.flux.safe[il-iflx]*wsp.weight[il];
+                    if (needed) {
+                        survived = true;
+                    } else {
+                        wsp.pruned.safe(k,i) = true;
+                    }
+                }
 
-                swfm += wsp.wmodel[il]*wsp.wflux[il];
-                swmm += sqr(wsp.wmodel[il]);
+                if (!survived) {
+                    // No need to compute the full chi2 for this model
+                    continue;
+                }
             }
 
-            spec_scale = swfm/swmm;
-
-            if (!is_finite(spec_scale)) {
-                // No spectral data
-                spec_scale = scale;
+            double* wfm  = &wsp.wfm.safe(k,0);
+            double* wmm  = &wsp.wmm.safe(k,0);
+            double* wff  = &wsp.wff.safe(k,0);
+            double* swfm = &wsp.swfm.safe(k,0);
+            double* swmm = &wsp.swmm.safe(k,0);
+            double* swff = &wsp.swff.safe(k,0);
+
+            const double ldust = model.props[prop_id::ldust];
+            for (uint_t i = 0; i < nt; ++i) {
+                double wm = ldust*wsp.lir_weight.safe[i];
+                wfm[i] = wm*wsp.lir_wflux.safe[i];
+                wmm[i] = wm*wm;
+                wff[i] = sqr(wsp.lir_wflux.safe[i]);
+                swfm[i] = swmm[i] = swff[i] = 0.0;
             }
-        }
 
-        // Compute chi2
-        double tchi2 = 0;
-        for (uint_t il : range(nscale)) {
-            tchi2 += sqr(wsp.wflux[il] - scale*wsp.wmodel[il]);
-        }
-        for (uint_t il : range(nscale, ndata)) {
-            tchi2 += sqr(wsp.wflux[il] - spec_scale*wsp.wmodel[il]);
-        }
+            if (use_wstore) {
+                // Weights are pre-computed, only multiply-adds left to do
+                const uint_t izs = (wstore.zdep ? iz.safe[k] : 0);
 
-        if (keepfit) {
-            // Save chi2 and properties
-            wsp.chi2.safe[i] = tchi2;
-            for (uint_t ip : range(model.props)) {
-                double tscale = (ip == prop_id::spec_scale ? scale/spec_scale : scale);
-                wsp.props.safe(i,ip) = (output.param_scale.safe[gridder.nparam+ip] ?
-                    tscale*model.props.safe[ip] : model.props.safe[ip]
-                );
+                for (uint_t i = 0; i < nt; ++i) {
+                    wff[i] += wstore.wff.safe(izs,j0+i);
+                    swff[i] += wstore.swff.safe(izs,j0+i);
+                }
+
+                for (uint_t il : range(nscale)) {
+                    const double m = model.flux[il];
+                    const double* w = &wstore.weight.safe(izs,il,j0);
+                    const double* wf = &wstore.wflux.safe(izs,il,j0);
+
+                    for (uint_t i = 0; i < nt; ++i) {
+                        double wm = m*w[i];
+                        wfm[i] += wm*wf[i];
+                        wmm[i] += wm*wm;
+                    }
+                }
+
+                for (uint_t il : range(nscale, nflux)) {
+                    const double m = model.flux[il];
+                    const double* w = &wstore.weight.safe(izs,il,j0);
+                    const double* wf = &wstore.wflux.safe(izs,il,j0);
+
+                    for (uint_t i = 0; i < nt; ++i) {
+                        double wm = m*w[i];
+                        swfm[i] += wm*wf[i];
+                        swmm[i] += wm*wm;
+                    }
+                }
+
+                continue;
             }
-        }
 
-        if (opts.parallel == parallel_choice::none) {
-            // Compare to best
-            // WARNING: read/modify shared resource
-            ++output.num_models[is];
-            if (output.best_chi2.safe[is]  > wsp.chi2.safe[i]) {
-                output.best_chi2.safe[is]  = wsp.chi2.safe[i];
-                output.best_model.safe[is] = model.igrid;
-                if (!opts.best_from_sim) {
-                    for (uint_t ip : range(model.props)) {
-                        output.best_params.safe(is,gridder.nparam+ip,0) = wsp.props.safe(i,ip);
+            for (uint_t il : range(nscale)) {
+                const double m = model.flux[il];
+                const double* f = &wsp.flux.safe(il,0);
+                const double* e = &wsp.edata.safe(il,0);
+
+                if (use_tplerr) {
+                    const double te = tpl_err.safe(iz.safe[k],il);
+                    for (uint_t i = 0; i < nt; ++i) {
+                        double w = 1.0/sqrt(e[i] + te*f[i]*f[i]);
+                        double wf = f[i]*w, wm = m*w;
+                        wfm[i] += wm*wf;
+                        wmm[i] += wm*wm;
+                        wff[i] += wf*wf;
                     }
+                } else {
+                    for (uint_t i = 0; i < nt; ++i) {
+                        double wf = f[i]*e[i], wm = m*e[i];
+                        wfm[i] += wm*wf;
+                        wmm[i] += wm*wm;
+                        wff[i] += wf*wf;
+                    }
+                }
+            }
+
+            for (uint_t il : range(nscale, nflux)) {
+                const double m = model.flux[il];
+                const double* f = &wsp.flux.safe(il,0);
+                const double* e = &wsp.edata.safe(il,0);
+
+                for (uint_t i = 0; i < nt; ++i) {
+                    double wf = f[i]*e[i], wm = m*e[i];
+                    swfm[i] += wm*wf;
+                    swmm[i] += wm*wm;
+                    swff[i] += wf*wf;
                 }
             }
         }
 
-        // Do MC simulation
-        if (opts.n_sim > 0) {
-            for (uint_t im : range(opts.n_sim)) {
-                // Generate "random" fluxes and compute scaling factor
-                // NB: since we create the randomness just once at the beginning of the fit
-                // all models (and each galaxy) will use the same random numbers
-                wfm = 0;
-                swfm = 0;
-                for (uint_t il : range(nscale)) {
-                    // In weighted units, the random perturbations have a sigma of unity
-                    wsp.rflux[il] = wsp.wflux[il] + sim_rnd.safe(im,il);
-                    wfm += wsp.wmodel[il]*wsp.rflux[il];
+        // Compute chi2, do simulations, and compare to best fits
+        for (uint_t k : range(nm)) {
+            const model_view_t& model = models[k];
+
+            wsp.nkept = 0;
+
+            for (uint_t i : range(nt)) {
+                uint_t is = gorder.safe[i + j0];
+
+                bool keepfit = true;
+                wsp.dofit.safe[i] = wsp.fitted.safe[k] && fit_status(is, iz.safe[k], keepfit);
+                if (!wsp.dofit.safe[i]) {
+                    // Skip this model
+                    continue;
                 }
-                for (uint_t il : range(nscale, ndata)) {
-                    // When auto scale is ON, spectral data doesn't participate in scale factor
-                    wsp.rflux[il] = wsp.wflux[il] + sim_rnd.safe(im,il);
-                    swfm += wsp.wmodel[il]*wsp.rflux[il];
+
+                if (use_pruning && wsp.pruned.safe(k,i)) {
+                    // This model cannot be the best fit
+                    continue;
                 }
 
-                scale = wfm/wmm;
+                double wfm  = wsp.wfm.safe(k,i),  wmm  = wsp.wmm.safe(k,i),  wff  = wsp.wff.safe(k,i);
+                double swfm = wsp.swfm.safe(k,i), swmm = wsp.swmm.safe(k,i), swff = wsp.swff.safe(k,i);
+
+                // Auto scaling for spectral data
+                // When enabled, spectral data doesn't participate in the global normalization,
+                // just to the chi2. It is separately rescaled to match the model, which is
+                // equivalent to assuming we don't know the absolute flux calibration but we are
+                // confident on the shape of the spectrum.
+                bool spec_auto_scale = opts.auto_scale && has_spec.safe[is];
                 if (!spec_auto_scale) {
-                    spec_scale = scale;
-                } else {
+                    wfm += swfm;  wmm += swmm;  wff += swff;
+                    swfm = 0.0;   swmm = 0.0;   swff = 0.0;
+                }
+
+                double scale = wfm/wmm;
+                double spec_scale = scale;
+                if (spec_auto_scale) {
                     spec_scale = swfm/swmm;
+
+                    if (!is_finite(spec_scale)) {
+                        // No spectral data
+                        spec_scale = scale;
+                    }
                 }
 
-                // Compute chi2
-                tchi2 = 0;
-                for (uint_t il : range(nscale)) {
-                    tchi2 += sqr(wsp.rflux[il] - scale*wsp.wmodel[il]);
+                // Compute chi2, expanding sum((wflux - scale*wmodel)^2)
+                double tchi2 = (wff - 2.0*scale*wfm + sqr(scale)*wmm) +
+                    (swff - 2.0*spec_scale*swfm + sqr(spec_scale)*swmm);
+                if (tchi2 < 0.0) {
+                    // Round-off error on a perfect fit
+                    tchi2 = 0.0;
                 }
-                for (uint_t il : range(nscale, ndata)) {
-                    tchi2 += sqr(wsp.rflux[il] - spec_scale*wsp.wmodel[il]);
+
+                if (keepfit && base_fit) {
+                    // Save chi2 and properties
+                    uint_t ik = wsp.nkept;
+                    ++wsp.nkept;
+
+                    wsp.ids.safe[ik] = is;
+                    wsp.chi2.safe[ik] = tchi2;
+                    for (uint_t ip : range(nprop)) {
+                        double tscale = (ip == prop_id::spec_scale ? scale/spec_scale : scale);
+                        wsp.props.safe(ik,ip) = (output.param_scale.safe[gridder.nparam+ip] ?
+                            tscale*model.props[ip] : model.props[ip]
+                        );
+                    }
                 }
 
-                if (opts.parallel == parallel_choice::none) {
-                    // Compare to best
-                    // WARNING: read/modify shared resource
-                    if (output.mc_best_chi2.safe(is,im)  > tchi2) {
-                        output.mc_best_chi2.safe(is,im)  = tchi2;
-                        output.mc_best_model.safe(is,im) = model.igrid;
-                        for (uint_t ip : range(model.props)) {
+                // Do MC simulation
+                if (opts.n_sim > 0) {
+                    // Re-build weighted fluxes and model for this source
+                    uint_t iflx = 0;
+                    if (has_lir && is_finite(input.lir.safe[is])) {
+                        wsp.wflux.safe[0] = wsp.lir_wflux.safe[i];
+                        wsp.wmodel.safe[0] = model.props[prop_id::ldust]*wsp.lir_weight.safe[i];
+                        ++iflx;
+                    }
+
+                    if (use_wstore) {
+                        const uint_t izs = (wstore.zdep ? iz.safe[k] : 0);
+                        for (uint_t il : range(nflux)) {
+                            wsp.wflux.safe[il+iflx] = wstore.wflux.safe(izs,il,i+j0);
+                            wsp.wmodel.safe[il+iflx] = model.flux[il]*wstore.weight.safe(izs,il,i+j0);
+                        }
+                    } else {
+                        for (uint_t il : range(nflux)) {
+                            double w = (use_tplerr && il < nscale ?
+                                1.0/sqrt(wsp.edata.safe(il,i) +
+                                    tpl_err.safe(iz.safe[k],il)*sqr(wsp.flux.safe(il,i))) :
+                                wsp.edata.safe(il,i));
+
+                            wsp.wflux.safe[il+iflx] = wsp.flux.safe(il,i)*w;
+                            wsp.wmodel.safe[il+iflx] = model.flux[il]*w;
+                        }
+                    }
+
+                    uint_t ndata = nflux + iflx;
+                    uint_t mscale = (spec_auto_scale ? nscale : nflux) + iflx;
+
+                    // NB: since we create the randomness just once at the beginning of the fit
+                    // all models (and each galaxy) will use the same random numbers, so we
+                    // expand the chi2 of each simulation with rflux = wflux + sim_rnd:
+                    //  sum(rflux*wmodel) = wfm + sum(sim_rnd*wmodel)
+                    //  sum(rflux^2)      = does not depend on the model, pre-computed
+                    // NB: when auto scale is ON, spectral data doesn't participate in scale factor
+                    const uint_t izs = (use_tplerr ? iz.safe[k] : 0);
+                    const double* mc_rff;
+                    const double* mc_srff;
+                    if (wstore.sims) {
+                        mc_rff = &wstore.rff.safe(izs,i+j0,0);
+                        mc_srff = &wstore.srff.safe(izs,i+j0,0);
+                    } else {
+                        // Compute once per source of the tile (and redshift)
+                        if (wsp.mc_izs.safe[i] != izs) {
+                            wsp.mc_izs.safe[i] = izs;
+                            sum_sim_rff(sim_rnd, wsp.wflux.data.data(), mscale, ndata, sim0, sim1,
+                                &wsp.mc_rff.safe(i,0), &wsp.mc_srff.safe(i,0));
+                        }
+
+                        mc_rff = &wsp.mc_rff.safe(i,0);
+                        mc_srff = &wsp.mc_srff.safe(i,0);
+                    }
+
+                    // Project the model on all the random perturbations at once
+                    for (uint_t im : range(sim0, sim1)) {
+                        const double* rnd = &sim_rnd.safe(im,0);
+                        double mwfm = 0.0, mswfm = 0.0;
+                        for (uint_t il = 0; il < mscale; ++il) {
+                            mwfm += wsp.wmodel.safe[il]*rnd[il];
+                        }
+                        for (uint_t il = mscale; il < ndata; ++il) {
+                            mswfm += wsp.wmodel.safe[il]*rnd[il];
+                        }
+
+                        wsp.mc_wfm.safe[im] = wfm + mwfm;
+                        wsp.mc_swfm.safe[im] = swfm + mswfm;
+                    }
+
+                    for (uint_t im : range(sim0, sim1)) {
+                        // Compute scaling factor
+                        const double twfm = wsp.mc_wfm.safe[im], tswfm = wsp.mc_swfm.safe[im];
+
+                        scale = twfm/wmm;
+                        if (!spec_auto_scale) {
+                            spec_scale = scale;
+                        } else {
+                            spec_scale = tswfm/swmm;
+                        }
+
+                        // Compute chi2
+                        tchi2 = (mc_rff[im] - 2.0*scale*twfm + sqr(scale)*wmm) +
+                            (mc_srff[im] - 2.0*spec_scale*tswfm + sqr(spec_scale)*swmm);
+                        if (tchi2 < 0.0) {
+                            // Round-off error on a perfect fit
+                            tchi2 = 0.0;
+                        }
+
+                        wsp.mc_chi2.safe[im] = tchi2;
+                        for (uint_t ip : range(nprop)) {
                             double tscale = (ip == prop_id::spec_scale ? scale/spec_scale : scale);
-                            output.mc_best_props.safe(is,ip,im) = (
-                                output.param_scale.safe[gridder.nparam+ip] ?
-                                tscale*model.props.safe[ip] : model.props.safe[ip]
+                            wsp.mc_props.safe(ip,im) = (output.param_scale.safe[gridder.nparam+ip] ?
+                                tscale*model.props[ip] : model.props[ip]
                             );
                         }
                     }
-                } else {
-                    // If multithreaded, accumulate simulated values and commit
-                    // them to the shared array in one batch
-                    wsp.mc_chi2.safe[im] = tchi2;
-                    for (uint_t ip : range(model.props)) {
-                        double tscale = (ip == prop_id::spec_scale ? scale/spec_scale : scale);
-                        wsp.mc_props.safe(ip,im) = (output.param_scale.safe[gridder.nparam+ip] ?
-                            tscale*model.props.safe[ip] : model.props.safe[ip]
-                        );
+
+                    // Compare to best
+                    for (uint_t im : range(sim0, sim1)) {
+                        if (is_better_fit(wsp.mc_chi2.safe[im], model.igrid,
+                            best.mc_chi2.safe(is,im), best.mc_model.safe(is,im))) {
+                            best.mc_chi2.safe(is,im)  = wsp.mc_chi2.safe[im];
+                            best.mc_model.safe(is,im) = model.igrid;
+                            for (uint_t ip : range(nprop)) {
+                                best.mc_props.safe(is,ip,im) = wsp.mc_props.safe(ip,im);
+                            }
+                        }
                     }
                 }
             }
 
-            if (opts.parallel != parallel_choice::none) {
-                // Compare to best
-                // WARNING: read/modify shared resource
-                std::lock_guard<std::mutex> lock(output.fit_result_mutex);
+            if (save_chi2 && base_fit) {
+                // For thread safety
+                auto lock = (opts.parallel != parallel_choice::none ?
+                    std::unique_lock<std::mutex>(ochi2.write_mutex) :
+                    std::unique_lock<std::mutex>());
+
+                write_chi2(model.igrid, wsp.ids, wsp.chi2, wsp.props, wsp.nkept);
+            }
+
+            if (!wsp.fitted.safe[k]) continue;
+
+            // Compare to best
+            for (uint_t i : range(nt)) {
+                if (base_fit && wsp.dofit.safe[i]) {
+                    ++best.num_models.safe[gorder.safe[i + j0]];
+                }
+            }
+
+            for (uint_t ik : range(wsp.nkept)) {
+                uint_t is = wsp.ids.safe[ik];
+                if (is_better_fit(wsp.chi2.safe[ik], model.igrid,
+                    best.chi2.safe[is], best.model.safe[is])) {
+                    best.chi2.safe[is]  = wsp.chi2.safe[ik];
+                    best.model.safe[is] = model.igrid;
+                    if (!opts.best_from_sim) {
+                        for (uint_t ip : range(nprop)) {
+                            best.props.safe(is,ip) = wsp.props.safe(ik,ip);
+                        }
+                    }
+                }
 
-                for (uint_t im : range(opts.n_sim)) {
-                    if (output.mc_best_chi2.safe(is,im)  > wsp.mc_chi2.safe[im]) {
-                        output.mc_best_chi2.safe(is,im)  = wsp.mc_chi2.safe[im];
-                        output.mc_best_model.safe(is,im) = model.igrid;
-                        for (uint_t ip : range(model.props)) {
-                            output.mc_best_props.safe(is,ip,im) = wsp.mc_props.safe(ip,im);
+                if (coarse_pass) {
+                    // Keep track of the best models of the coarse grid, sorted by chi2
+                    const float tchi2 = wsp.chi2.safe[ik];
+                    uint_t j = best.top_chi2.dims[1];
+                    while (j > 0 && is_better_fit(tchi2, model.igrid,
+                        best.top_chi2.safe(is,j-1), best.top_model.safe(is,j-1))) {
+                        if (j < best.top_chi2.dims[1]) {
+                            best.top_chi2.safe(is,j)  = best.top_chi2.safe(is,j-1);
+                            best.top_model.safe(is,j) = best.top_model.safe(is,j-1);
                         }
+                        --j;
+                    }
+
+                    if (j < best.top_chi2.dims[1]) {
+                        best.top_chi2.safe(is,j)  = tchi2;
+                        best.top_model.safe(is,j) = model.igrid;
                     }
                 }
             }
         }
     }
+}
 
-    if (save_chi2) {
-        if (opts.parallel == parallel_choice::none) {
-            write_chi2(model.igrid, wsp.chi2, wsp.props, i0);
-        } else {
-            // For thread safety
-            std::lock_guard<std::mutex> lock(ochi2.write_mutex);
-            write_chi2(model.igrid, wsp.chi2, wsp.props, i0);
+fitter_t::model_batch fitter_t::get_batch() {
+    {
+        std::unique_lock<std::mutex> lock(batch_mutex);
+        if (!free_batches.empty()) {
+            model_batch b = std::move(free_batches.back());
+            free_batches.pop_back();
+            return b;
         }
     }
 
-    if (opts.parallel != parallel_choice::none) {
-        // Compare to best
-        // WARNING: read/modify shared resource
-        std::lock_guard<std::mutex> lock(output.fit_result_mutex);
-
-        for (uint_t i : range(i1-i0)) {
-            uint_t is = i + i0;
-            ++output.num_models[is];
-            if (output.best_chi2.safe[is]  > wsp.chi2[i]) {
-                output.best_chi2.safe[is]  = wsp.chi2[i];
-                output.best_model.safe[is] = model.igrid;
-                if (!opts.best_from_sim) {
-                    for (uint_t ip : range(model.props)) {
-                        output.best_params.safe(is,gridder.nparam+ip,0) = wsp.props.safe(i,ip);
-                    }
-                }
-            }
-        }
+    // No batch available, allocate a new one
+    model_batch b;
+    b.models.resize(batch_size);
+    b.views.resize(batch_size);
+    for (uint_t i : range(batch_size)) {
+        model_t& m = b.models.safe[i];
+        m.flux.resize(input.lambda.size());
+        m.props.resize(gridder.nprop);
+        b.views.safe[i] = model_view_t(m);
     }
+
+    return b;
 }
 
-void fitter_t::fit(const model_t& model) {
-    if (opts.parallel == parallel_choice::sources) {
-        workers_multi_source->process(model);
+void fitter_t::recycle_batch(model_batch&& models) {
+    if (models.models.size() != batch_size) return;
+
+    models.size = 0;
+
+    std::unique_lock<std::mutex> lock(batch_mutex);
+    free_batches.push_back(std::move(models));
+}
+
+void fitter_t::fit_batch(model_batch models) {
+    if (models.size == 0) {
+        recycle_batch(std::move(models));
+        return;
+    }
+
+    if (opts.parallel == parallel_choice::sources ||
+        opts.parallel == parallel_choice::simulations) {
+        workers_multi_source->process(std::move(models));
     } else if (opts.parallel == parallel_choice::models) {
-        workers_multi_model->process(model);
+        workers_multi_model->process(std::move(models));
     } else {
-        fit_galaxies(model, 0, input.id.size());
+        fit_galaxies(models.views.data.data(), models.size, 0, 1);
+        recycle_batch(std::move(models));
+    }
+}
+
+void fitter_t::fit(const model_t& model) {
+    fit(model_view_t(model));
+}
+
+void fitter_t::fit(const model_view_t& model) {
+    ++nfit_models;
+
+    if (opts.parallel == parallel_choice::generators) {
+        // Models are sent concurrently by the generator threads, fit them right away
+        fit_galaxies(&model, 1, 0, 1);
+        return;
+    }
+
+    if (pending_models.models.empty()) {
+        pending_models = get_batch();
+    }
+
+    // Copy in the existing storage of the batch
+    const uint_t i = pending_models.size;
+    model_t& m = pending_models.models.safe[i];
+    std::copy(model.flux, model.flux + m.flux.size(), m.flux.data.begin());
+    std::copy(model.props, model.props + m.props.size(), m.props.data.begin());
+    m.igrid = model.igrid;
+    pending_models.views.safe[i].igrid = model.igrid;
+
+    ++pending_models.size;
+    if (pending_models.size >= batch_size) {
+        fit_batch(std::move(pending_models));
+        pending_models = model_batch();
+    }
+}
+
+void fitter_t::fit(const model_view_t* models, uint_t nm) {
+    if (opts.parallel == parallel_choice::generators) {
+        // Models are sent concurrently by the reader threads, fit them right away
+        // NB: the models are fit in place, e.g., in the memory-mapped cache
+        nfit_models += nm;
+        fit_galaxies(models, nm, 0, 1);
+        return;
+    }
+
+    for (uint_t i = 0; i < nm; ++i) {
+        fit(models[i]);
     }
 }
 
@@ -710,15 +1478,96 @@ vec2d make_grid_bins(const vec1d& grid) {
     return bins;
 }
 
+void fitter_t::start_coarse_pass() {
+    coarse_pass = true;
+}
+
+vec1u fitter_t::end_coarse_pass() {
+    // Fit the last incomplete batch and wait for all models to finish
+    fit_batch(std::move(pending_models));
+    pending_models = model_batch();
+
+    if (opts.parallel == parallel_choice::models) {
+        workers_multi_model->workers.consume_all();
+    } else if (opts.parallel == parallel_choice::sources ||
+        opts.parallel == parallel_choice::simulations) {
+        workers_multi_source->workers.consume_all();
+    }
+
+    coarse_pass = false;
+
+    // Gather the best models of each galaxy, including in the simulations
+    vec1u seeds;
+    for (const auto& best : best_fits) {
+        for (uint_t m : best.top_model) {
+            if (m != npos) seeds.push_back(m);
+        }
+        for (uint_t m : best.mc_model) {
+            if (m != npos) seeds.push_back(m);
+        }
+    }
+
+    // Remove duplicates
+    inplace_sort(seeds);
+    uint_t nuniq = 0;
+    for (uint_t i : range(seeds)) {
+        if (nuniq == 0 || seeds.safe[i] != seeds.safe[nuniq-1]) {
+            seeds.safe[nuniq] = seeds.safe[i];
+            ++nuniq;
+        }
+    }
+
+    seeds.resize(nuniq);
+
+    return seeds;
+}
+
 void fitter_t::find_best_fits() {
+    // Fit the last incomplete batch
+    fit_batch(std::move(pending_models));
+    pending_models = model_batch();
+
     if (opts.parallel == parallel_choice::models) {
         if (opts.verbose) note("waiting for all models to finish...");
         workers_multi_model->workers.join();
-    } else if (opts.parallel == parallel_choice::sources) {
+    } else if (opts.parallel == parallel_choice::sources ||
+        opts.parallel == parallel_choice::simulations) {
         if (opts.verbose) note("waiting for all models to finish...");
         workers_multi_source->workers.join();
     }
 
+    // Merge best fits of all threads
+    if (opts.verbose && best_fits.size() > 1) note("merging best fits of all threads...");
+    for (const auto& best : best_fits) {
+        for (uint_t is : range(input.id)) {
+            output.num_models.safe[is] += best.num_models.safe[is];
+
+            if (is_better_fit(best.chi2.safe[is], best.model.safe[is],
+                output.best_chi2.safe[is], output.best_model.safe[is])) {
+                output.best_chi2.safe[is]  = best.chi2.safe[is];
+                output.best_model.safe[is] = best.model.safe[is];
+                if (!opts.best_from_sim) {
+                    for (uint_t ip : range(gridder.nprop)) {
+                        output.best_params.safe(is,gridder.nparam+ip,0) = best.props.safe(is,ip);
+                    }
+                }
+            }
+
+            for (uint_t im : range(opts.n_sim)) {
+                if (is_better_fit(best.mc_chi2.safe(is,im), best.mc_model.safe(is,im),
+                    output.mc_best_chi2.safe(is,im), output.mc_best_model.safe(is,im))) {
+                    output.mc_best_chi2.safe(is,im)  = best.mc_chi2.safe(is,im);
+                    output.mc_best_model.safe(is,im) = best.mc_model.safe(is,im);
+                    for (uint_t ip : range(gridder.nprop)) {
+                        output.mc_best_props.safe(is,ip,im) = best.mc_props.safe(is,ip,im);
+                    }
+                }
+            }
+        }
+    }
+
+    best_fits.clear();
+
     bool silence_invalid_chi2 = false;
 
     if (opts.verbose) note("finding best fits...");
@@ -180,16 +180,52 @@ int vif_main(int argc, char* argv[]) {
                 in.read(grid[i]);
             }
 
+            // uint32: number of models stored in the file
+            // uint8[*]: bit mask of models stored in the file
+            // NB: older files do not have these, and store all the models
+            vec1b stored = replicate(true, nmodel);
+            uint_t nstored = nmodel;
+            if (uint_t(in.in.tellg()) < hpos) {
+                state = "reading list of stored models";
+                if (debug) note(state);
+
+                std::uint32_t tnstored;
+                in.read(tnstored);
+                nstored = tnstored;
+
+                vec<1,std::uint8_t> bits((nmodel+7)/8);
+                in.read(bits);
+                for (uint_t im : range(nmodel)) {
+                    stored.safe[im] = (bits.safe[im/8] >> (im % 8)) & 1;
+                }
+            }
+
             print("found ", ngal, " galaxies, with ", nprop, " properties, ", ngrid,
-                " grid parameters and ", nmodel, " models");
+                " grid parameters and ", nmodel, " models (", nstored, " stored)");
             print("grid names: ", collapse(grid_names, ", "));
             print("prop names: ", collapse(prop_names, ", "));
 
             main_state = "read data";
 
             state = "properties";
-            props.resize(nmodel, ngal, 1+nprop);
-            in.read(props);
+            in.seekg(hpos);
+            if (nstored == nmodel) {
+                props.resize(nmodel, ngal, 1+nprop);
+                in.read(props);
+            } else {
+                // Models which could not be fit are not stored, fill them with NaN
+                vec3f tprops(nstored, ngal, 1+nprop);
+                in.read(tprops);
+
+                props = replicate(fnan, nmodel, ngal, 1+nprop);
+                uint_t is = 0;
+                for (uint_t im : range(nmodel)) {
+                    if (stored.safe[im]) {
+                        props.safe(im,_,_) = tprops.safe(is,_,_);
+                        ++is;
+                    }
+                }
+            }
 
             prepend(prop_names, vec1s{"chi2"});
         } catch (...) {
@@ -0,0 +1,1380 @@
+#include "fast++.hpp"
+#include <cstring>
+#include <cmath>
+#include <cerrno>
+#include <atomic>
+#include <cstdlib>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Cache file format
+// -----------------
+// The file starts with a header (cache_header_t), followed by blocks of 'block_size' model
+// records (the last block may be shorter). Each record is the grid ID of the model (uint32),
+// followed by its properties and fluxes (float32). Each block is followed by a trailer
+// (cache_trailer_t) containing the number of records in the block and their checksum.
+// Models are stored in the order in which they were generated. Only the models that can be fit
+// are stored (see gridder_t::model_valid), and the cache is complete once they are all there.
+//
+// Column cache format (CACHE_COLUMNS)
+// -----------------------------------
+// Each flux channel, and the model properties, are stored in a separate file made of a header
+// (column_header_t) followed by the values of all the models that can be fit, in grid order
+// (the position of a model is its rank in gridder_t::model_valid). The header contains the
+// checksum of the values, and a flag which is only set once they are all written.
+//
+// SED cache format (SED_CACHE)
+// ----------------------------
+// The file starts with a header (sed_header_t), followed by one record per custom SFH parameter
+// combination and age, in grid order. Each record is a checksum (uint64), a scale factor
+// (float32), the properties that do not depend on dust and redshift (float32), and the SED on
+// the full wavelength grid of the library, divided by the scale factor (float16), padded to a
+// multiple of 8 bytes. A record is valid if its checksum matches, so the file can be filled
+// progressively, in any order.
+
+namespace {
+    const char cache_magic[8] = {'F','A','S','T','G','R','I','D'};
+    const std::uint32_t cache_version = 3;
+    const std::uint32_t block_magic = 0x4b4c4246; // "FBLK"
+
+    struct cache_header_t {
+        char          magic[8];
+        std::uint32_t version;
+        std::uint32_t nprop;
+        std::uint32_t nflux;
+        std::uint32_t block_size;
+        std::uint64_t nmodel;
+        char          hash[96];
+    };
+
+    struct cache_trailer_t {
+        std::uint32_t nrecord;
+        std::uint32_t magic;
+        std::uint64_t checksum;
+    };
+
+    const char column_magic[8] = {'F','A','S','T','C','O','L','M'};
+    const std::uint32_t column_version = 2;
+
+    struct column_header_t {
+        char          magic[8];
+        std::uint32_t version;
+        std::uint32_t complete;
+        std::uint64_t nmodel;
+        std::uint64_t nvalue;
+        std::uint64_t checksum;
+        char          hash[88];
+    };
+
+    const char sed_magic[8] = {'F','A','S','T','S','E','D','C'};
+    const std::uint32_t sed_version = 1;
+
+    struct sed_header_t {
+        char          magic[8];
+        std::uint32_t version;
+        std::uint32_t nlam;
+        std::uint32_t nvalue;
+        std::uint32_t reserved;
+        std::uint64_t nrecord;
+        char          hash[96];
+    };
+
+    static_assert(sizeof(cache_header_t) == 128, "unexpected padding in cache header");
+    static_assert(sizeof(column_header_t) == 128, "unexpected padding in column header");
+    static_assert(sizeof(sed_header_t) == 128, "unexpected padding in SED cache header");
+    static_assert(sizeof(cache_trailer_t) == 16, "unexpected padding in cache trailer");
+
+    const std::uint64_t checksum_init = 14695981039346656037ull;
+
+    // FNV-1a on 32-bit words (records are only made of 32-bit values)
+    std::uint64_t cache_checksum(const char* data, uint_t size, std::uint64_t h) {
+        for (uint_t i = 0; i+4 <= size; i += 4) {
+            std::uint32_t w;
+            std::memcpy(&w, data + i, 4);
+            h = (h ^ w)*1099511628211ull;
+        }
+
+        return h;
+    }
+
+    // Models are read from the cache in batches, which are fit right away
+    // NB: models are not copied, views point directly to the records of the cache
+    struct cache_reader_workspace_t {
+        vec<1,model_view_t> models;
+        vec2f flux;                // [nbatch,nflux] fluxes gathered from the columns
+        std::vector<float> buffer; // block read from the file, when not mapped
+
+        explicit cache_reader_workspace_t(uint_t nflux, uint_t nbatch) {
+            models.resize(nbatch);
+            flux.resize(nbatch, nflux);
+        }
+    };
+}
+
+void gridder_t::cache_manager_t::init(const std::string& filename, const std::string& hash,
+    uint_t tnmodel, uint_t tnflux, uint_t tnprop) {
+
+    cache_filename = filename;
+    grid_hash = hash;
+    nmodel = tnmodel;
+    nflux = tnflux;
+    nprop = tnprop;
+
+    // Blocks of about 1 MB
+    block_size = std::max(uint_t(1), uint_t(1024*1024)/record_size());
+}
+
+uint_t gridder_t::cache_manager_t::record_size() const {
+    return sizeof(std::uint32_t) + sizeof(float)*(nprop + nflux);
+}
+
+uint_t gridder_t::cache_manager_t::header_size() const {
+    return sizeof(cache_header_t);
+}
+
+uint_t gridder_t::cache_manager_t::block_offset(uint_t ib) const {
+    return header_size() + ib*(block_size*record_size() + sizeof(cache_trailer_t));
+}
+
+uint_t gridder_t::cache_manager_t::block_records(uint_t ib) const {
+    return std::min(block_size, nmodel - ib*block_size);
+}
+
+uint_t gridder_t::cache_manager_t::block_bytes(uint_t ib) const {
+    return block_records(ib)*record_size() + sizeof(cache_trailer_t);
+}
+
+uint_t gridder_t::cache_manager_t::blocks_end(uint_t nb) const {
+    // NB: only the last block of the file can be shorter than block_size
+    return nb == 0 ? header_size() : block_offset(nb-1) + block_bytes(nb-1);
+}
+
+bool gridder_t::cache_manager_t::check(bool verbose) {
+    complete = false;
+    nblock = 0;
+
+    std::ifstream in(cache_filename, std::ios::binary);
+    if (!in.is_open()) return false;
+
+    in.seekg(0, std::ios_base::end);
+    uint_t size = in.tellg();
+    in.seekg(0, std::ios_base::beg);
+
+    cache_header_t header;
+    if (size < sizeof(header) || !in.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+        warning("cache file is corrupted or invalid, will overwrite it");
+        warning("file is too small to contain the header");
+        return false;
+    }
+
+    std::string hash(header.hash, strnlen(header.hash, sizeof(header.hash)));
+    if (std::memcmp(header.magic, cache_magic, sizeof(cache_magic)) != 0 ||
+        header.version != cache_version) {
+        warning("cache file is invalid or has an older format, will overwrite it");
+        return false;
+    }
+
+    if (hash != grid_hash || header.nmodel != nmodel || header.nflux != nflux ||
+        header.nprop != nprop || header.block_size != block_size) {
+        warning("cache file does not match the current grid, will overwrite it");
+        return false;
+    }
+
+    // Count complete blocks; their content is checked when they are read
+    const uint_t nblock_tot = (nmodel + block_size - 1)/block_size;
+    while (nblock < nblock_tot && block_offset(nblock) + block_bytes(nblock) <= size) {
+        ++nblock;
+    }
+
+    // Check the trailer of the last block
+    if (nblock > 0) {
+        cache_trailer_t trailer;
+        in.seekg(block_offset(nblock-1) + block_bytes(nblock-1) - sizeof(trailer));
+        if (!in.read(reinterpret_cast<char*>(&trailer), sizeof(trailer)) ||
+            trailer.magic != block_magic || trailer.nrecord != block_records(nblock-1)) {
+            // Partially written block, ignore it
+            --nblock;
+        }
+    }
+
+    complete = (nblock == nblock_tot && blocks_end(nblock) == size);
+
+    if (verbose) {
+        if (complete) {
+            note("cache file exists and seems valid, will use it");
+        } else if (nblock > 0) {
+            note("cache file is incomplete (", nblock, " blocks out of ", nblock_tot,
+                "), will resume building it");
+        }
+    }
+
+    if (!complete && nblock == 0) {
+        warning("cache file is incomplete and contains no usable data, will overwrite it");
+    }
+
+    return complete || nblock > 0;
+}
+
+bool gridder_t::cache_manager_t::verify_block(uint_t ib, const char* data) const {
+    const uint_t nrec = block_records(ib);
+
+    cache_trailer_t trailer;
+    std::memcpy(&trailer, data + nrec*record_size(), sizeof(trailer));
+
+    return trailer.magic == block_magic && trailer.nrecord == nrec &&
+        trailer.checksum == cache_checksum(data, nrec*record_size(), checksum_init);
+}
+
+// Background cache writer
+// Generator threads copy their models into a ring of records (a bounded lock-free queue,
+// after D. Vyukov), and a dedicated thread moves them into a staging buffer which is
+// written to disk in large blocks. Generator threads only wait if the ring is full, and the
+// writer thread sleeps when the ring is empty; each side only takes the lock to wake up the
+// other if it is parked.
+struct gridder_t::cache_manager_t::writer_t {
+    std::string filename;
+    int fd = -1;
+    bool direct = false;
+    uint_t nflux = 0, nprop = 0, rsize = 0;
+
+    // Ring of records: slot i is free for position p when seq[i] == p, and holds
+    // the record of position p when seq[i] == p+1
+    uint_t nslot = 0;
+    std::unique_ptr<std::atomic<uint_t>[]> seq; // [nslot]
+    std::vector<char> ring;                     // [nslot*rsize]
+    std::atomic<uint_t> push_pos;
+    uint_t pop_pos = 0;
+
+    // Staging buffer, aligned for O_DIRECT
+    char* stage = nullptr;
+    uint_t stage_size = 0;
+    uint_t stage_used = 0;
+
+    // Current block
+    uint_t block_size = 0;
+    uint_t block_nrecord = 0;
+    std::uint64_t block_checksum = checksum_init;
+
+    std::atomic<bool> closing;
+    std::atomic<bool> failed;
+    std::thread impl;
+
+    // Parking of the writer thread (ring empty) and of the generator threads (ring full)
+    // NB: the flags are checked after a full memory fence on both sides, so that a record
+    // (or a free slot) cannot be published while the other side is going to sleep unnoticed
+    std::mutex park_mutex;
+    std::condition_variable data_cv;   // signals new records (or closing) to the writer
+    std::condition_variable space_cv;  // signals free slots to the generator threads
+    std::atomic<bool> writer_parked;
+    std::atomic<uint_t> nparked;       // generator threads waiting for a free slot
+
+    writer_t() : push_pos(0), closing(false), failed(false), writer_parked(false), nparked(0) {}
+
+    ~writer_t() {
+        close();
+        std::free(stage);
+    }
+
+    // Open the file and write the header, or resume writing after 'offset' bytes
+    bool open(const cache_manager_t& cache, uint_t offset, double buffer_size, bool use_direct) {
+        filename = cache.cache_filename;
+        nflux = cache.nflux;
+        nprop = cache.nprop;
+        rsize = cache.record_size();
+        block_size = cache.block_size;
+
+        int flags = O_WRONLY | O_CREAT;
+        if (offset == 0) {
+            flags |= O_TRUNC;
+        }
+
+#ifdef O_DIRECT
+        // NB: with O_DIRECT, writes must start at an aligned offset
+        if (use_direct && offset == 0) {
+            fd = ::open(filename.c_str(), flags | O_DIRECT, 0644);
+            direct = (fd >= 0);
+        }
+#else
+        (void)use_direct;
+#endif
+        if (fd < 0) {
+            // NB: O_DIRECT is not supported by all file systems
+            fd = ::open(filename.c_str(), flags, 0644);
+        }
+
+        if (fd < 0) return false;
+
+        if (offset > 0) {
+            // Discard incomplete blocks
+            if (::ftruncate(fd, offset) != 0 || ::lseek(fd, offset, SEEK_SET) < 0) {
+                ::close(fd);
+                fd = -1;
+                return false;
+            }
+        }
+
+        // A quarter of the memory for the staging buffer, the rest for the ring
+        const uint_t align = 4096;
+        stage_size = std::max(align, uint_t(0.25*buffer_size)/align*align);
+        if (::posix_memalign(reinterpret_cast<void**>(&stage), align, stage_size) != 0) {
+            stage = nullptr;
+            ::close(fd);
+            fd = -1;
+            return false;
+        }
+
+        nslot = 16;
+        while (2*nslot*rsize <= buffer_size - stage_size) {
+            nslot *= 2;
+        }
+
+        seq.reset(new std::atomic<uint_t>[nslot]);
+        for (uint_t i = 0; i < nslot; ++i) {
+            seq[i] = i;
+        }
+
+        ring.resize(nslot*rsize);
+
+        if (offset == 0) {
+            cache_header_t header;
+            std::memset(&header, 0, sizeof(header));
+            std::memcpy(header.magic, cache_magic, sizeof(cache_magic));
+            header.version = cache_version;
+            header.nprop = nprop;
+            header.nflux = nflux;
+            header.block_size = block_size;
+            header.nmodel = cache.nmodel;
+            std::strncpy(header.hash, cache.grid_hash.c_str(), sizeof(header.hash)-1);
+            append(reinterpret_cast<const char*>(&header), sizeof(header));
+        }
+
+        impl = std::thread([this]() { run(); });
+
+        return true;
+    }
+
+    uint_t memory() const {
+        return stage_size + ring.size();
+    }
+
+    void push(const model_t& model) {
+        if (failed) return;
+
+        // Claim a slot
+        uint_t pos = push_pos.load(std::memory_order_relaxed);
+        while (true) {
+            uint_t s = seq[pos % nslot].load(std::memory_order_acquire);
+            if (s == pos) {
+                if (push_pos.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (s < pos) {
+                // Ring is full, sleep until the writer releases this slot
+                std::unique_lock<std::mutex> lock(park_mutex);
+                ++nparked;
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                space_cv.wait(lock, [&]() {
+                    return seq[pos % nslot].load(std::memory_order_acquire) >= pos;
+                });
+                --nparked;
+                lock.unlock();
+
+                pos = push_pos.load(std::memory_order_relaxed);
+            } else {
+                pos = push_pos.load(std::memory_order_relaxed);
+            }
+        }
+
+        // Copy the record and publish it
+        char* p = ring.data() + (pos % nslot)*rsize;
+        std::uint32_t igrid = model.igrid;
+        std::memcpy(p, &igrid, sizeof(igrid));
+        p += sizeof(igrid);
+        std::memcpy(p, model.props.data.data(), sizeof(float)*nprop);
+        p += sizeof(float)*nprop;
+        std::memcpy(p, model.flux.data.data(), sizeof(float)*nflux);
+
+        seq[pos % nslot].store(pos+1, std::memory_order_release);
+
+        // Wake up the writer if it is sleeping
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (writer_parked) {
+            { std::unique_lock<std::mutex> lock(park_mutex); }
+            data_cv.notify_one();
+        }
+    }
+
+    bool has_record() const {
+        return seq[pop_pos % nslot].load(std::memory_order_acquire) == pop_pos+1;
+    }
+
+    void fail() {
+        if (failed) return;
+        failed = true;
+
+        print("");
+        warning("could not write to cache file anymore");
+        warning("in case you ran out of disk space, the cache file has been removed");
+        print("");
+
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+
+        file::remove(filename);
+    }
+
+    void write_stage() {
+        const char* p = stage;
+        uint_t n = stage_used;
+        while (n > 0 && !failed) {
+            ssize_t nw = ::write(fd, p, n);
+            if (nw < 0) {
+                if (errno == EINTR) continue;
+                fail();
+            } else {
+                p += nw;
+                n -= nw;
+            }
+        }
+
+        stage_used = 0;
+    }
+
+    void append(const char* p, uint_t n) {
+        while (n > 0) {
+            uint_t nc = std::min(n, stage_size - stage_used);
+            std::memcpy(stage + stage_used, p, nc);
+            stage_used += nc;
+            p += nc;
+            n -= nc;
+
+            // NB: only full blocks are written, so writes remain aligned
+            if (stage_used == stage_size) {
+                write_stage();
+            }
+        }
+    }
+
+    void end_block() {
+        cache_trailer_t trailer;
+        trailer.nrecord = block_nrecord;
+        trailer.magic = block_magic;
+        trailer.checksum = block_checksum;
+        append(reinterpret_cast<const char*>(&trailer), sizeof(trailer));
+
+        block_nrecord = 0;
+        block_checksum = checksum_init;
+    }
+
+    // Move all the available records from the ring to the staging buffer
+    uint_t drain() {
+        uint_t npop = 0;
+        while (true) {
+            uint_t slot = pop_pos % nslot;
+            if (seq[slot].load(std::memory_order_acquire) != pop_pos+1) break;
+
+            if (!failed) {
+                const char* p = ring.data() + slot*rsize;
+                append(p, rsize);
+                block_checksum = cache_checksum(p, rsize, block_checksum);
+                ++block_nrecord;
+                if (block_nrecord == block_size) {
+                    end_block();
+                }
+            }
+
+            // Release the slot for the next round
+            seq[slot].store(pop_pos+nslot, std::memory_order_release);
+            ++pop_pos;
+            ++npop;
+        }
+
+        return npop;
+    }
+
+    void run() {
+        while (true) {
+            if (drain() > 0) {
+                // Wake up the generator threads waiting for a free slot
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (nparked > 0) {
+                    { std::unique_lock<std::mutex> lock(park_mutex); }
+                    space_cv.notify_all();
+                }
+
+                continue;
+            }
+
+            if (closing && pop_pos == push_pos) break;
+
+            // Nothing to write, sleep until a record is published
+            std::unique_lock<std::mutex> lock(park_mutex);
+            writer_parked = true;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            data_cv.wait(lock, [this]() { return closing || has_record(); });
+            writer_parked = false;
+        }
+
+        if (!failed && block_nrecord > 0) {
+            end_block();
+        }
+
+        if (!failed && stage_used > 0) {
+#ifdef O_DIRECT
+            if (direct) {
+                // The last block is incomplete, it cannot be written with O_DIRECT
+                ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) & ~O_DIRECT);
+            }
+#endif
+            write_stage();
+        }
+
+        if (!failed) {
+            int ret = ::close(fd);
+            fd = -1;
+            if (ret != 0) {
+                fail();
+            }
+        }
+    }
+
+    void close() {
+        if (!impl.joinable()) return;
+
+        {
+            std::unique_lock<std::mutex> lock(park_mutex);
+            closing = true;
+        }
+
+        data_cv.notify_one();
+        impl.join();
+    }
+};
+
+bool gridder_t::cache_manager_t::open_write(double buffer_size, bool direct) {
+    // Keep the blocks that are already there, if any
+    uint_t offset = (nblock > 0 ? blocks_end(nblock) : 0);
+
+    writer.reset(new writer_t());
+    if (!writer->open(*this, offset, buffer_size, direct)) {
+        writer.reset();
+        return false;
+    }
+
+    return true;
+}
+
+bool gridder_t::cache_manager_t::writing() const {
+    return writer && !writer->failed;
+}
+
+uint_t gridder_t::cache_manager_t::write_memory() const {
+    return writer ? writer->memory() : 0;
+}
+
+void gridder_t::cache_manager_t::close_write() {
+    // Wait for all the models to be written
+    writer.reset();
+}
+
+void gridder_t::cache_manager_t::write_model(const model_t& model) {
+    if (!writer) return;
+
+    writer->push(model);
+}
+
+bool gridder_t::cache_manager_t::map(bool huge_pages) {
+    if (map_data) return true;
+
+    int fd = ::open(cache_filename.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || st.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+
+    void* data = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd); // NB: the mapping remains valid
+    if (data == MAP_FAILED) return false;
+
+    map_data = static_cast<const char*>(data);
+    map_size = st.st_size;
+
+    // The file is read from start to end, let the kernel read ahead aggressively
+    ::madvise(data, map_size, MADV_SEQUENTIAL);
+
+#ifdef MADV_HUGEPAGE
+    if (huge_pages) {
+        // NB: not supported by all file systems, ignore failures
+        ::madvise(data, map_size, MADV_HUGEPAGE);
+    }
+#else
+    (void)huge_pages;
+#endif
+
+    return true;
+}
+
+void gridder_t::cache_manager_t::unmap() {
+    if (!map_data) return;
+
+    ::munmap(const_cast<char*>(map_data), map_size);
+    map_data = nullptr;
+    map_size = 0;
+}
+
+gridder_t::cache_manager_t::~cache_manager_t() {
+    unmap();
+}
+
+bool gridder_t::read_and_send_cache(fitter_t& fitter, bit_mask_t* present) {
+    const uint_t nflux = cache.nflux;
+    const uint_t rsize = cache.record_size();
+    const bool resume = (present != nullptr);
+
+    // NB: when resuming, blocks must be checked in order, to stop at the first bad one
+    bool mapped = opts.cache_mmap && cache.map(opts.cache_huge_pages);
+    if (opts.cache_mmap && !mapped && opts.verbose) {
+        note("could not map the cache file in memory, reading it sequentially");
+    }
+
+    if (!mapped) {
+        cache.cache_file.open(cache.cache_filename, std::ios::binary | std::ios::in);
+    }
+
+    const long page_size = ::sysconf(_SC_PAGESIZE);
+    const bool parallel = mapped && !resume &&
+        opts.parallel == parallel_choice::generators && opts.n_thread > 1;
+    std::atomic<uint_t> first_bad(npos);
+
+    auto pg = progress_start(cache.nmodel);
+    auto do_block = [&](cache_reader_workspace_t& ws, uint_t& ib) {
+        const uint_t nrec = cache.block_records(ib);
+        const char* beg = nullptr;
+
+        if (mapped) {
+            beg = cache.map_data + cache.block_offset(ib);
+
+            // Ask the kernel to start reading this block
+            if (page_size > 0) {
+                std::uintptr_t abeg = reinterpret_cast<std::uintptr_t>(beg);
+                abeg -= abeg % page_size;
+                ::madvise(reinterpret_cast<void*>(abeg),
+                    reinterpret_cast<std::uintptr_t>(beg) + cache.block_bytes(ib) - abeg,
+                    MADV_WILLNEED);
+            }
+        } else {
+            // NB: records are made of 32-bit values, read them in a float buffer so the
+            // fluxes and properties can be used in place
+            const uint_t nbyte = cache.block_bytes(ib);
+            ws.buffer.resize((nbyte + sizeof(float) - 1)/sizeof(float));
+            char* pbuf = reinterpret_cast<char*>(ws.buffer.data());
+            cache.cache_file.seekg(cache.block_offset(ib));
+            if (!cache.cache_file.read(pbuf, nbyte)) {
+                ws.buffer.assign(ws.buffer.size(), 0.0f);
+            }
+
+            beg = pbuf;
+        }
+
+        // Check the block before using any of its models
+        bool good = cache.verify_block(ib, beg);
+        for (uint_t i = 0; good && i < nrec; ++i) {
+            std::uint32_t igrid;
+            std::memcpy(&igrid, beg + i*rsize, sizeof(igrid));
+            good = igrid < nmodel;
+        }
+
+        if (!good) {
+            uint_t prev = first_bad;
+            while (ib < prev && !first_bad.compare_exchange_weak(prev, ib)) {}
+            return;
+        }
+
+        uint_t nm = 0;
+        for (uint_t i = 0; i < nrec; ++i) {
+            const char* p = beg + i*rsize;
+            std::uint32_t igrid;
+            std::memcpy(&igrid, p, sizeof(igrid));
+
+            if (resume) {
+                present->set(igrid, true);
+            }
+
+            bool nofit = !model_valid.get(igrid) ||
+                (!model_mask.empty() && !model_mask.get(igrid));
+            if (nofit) continue;
+
+            // NB: records are aligned on 32 bits
+            const float* pdata = reinterpret_cast<const float*>(p + sizeof(igrid));
+            model_view_t& model = ws.models.safe[nm];
+            model.igrid = igrid;
+            model.props = pdata;
+            model.flux = pdata + nprop;
+
+            ++nm;
+            if (nm == ws.models.size()) {
+                fitter.fit(ws.models.data.data(), nm);
+                nm = 0;
+            }
+        }
+
+        if (nm > 0) {
+            fitter.fit(ws.models.data.data(), nm);
+        }
+
+        if (opts.verbose) {
+            auto lock = (parallel ?
+                std::unique_lock<std::mutex>(progress_mutex) : std::unique_lock<std::mutex>());
+
+            for (uint_t i = 0; i < nrec; ++i) {
+                progress_tick(pg, 0.5);
+            }
+        }
+    };
+
+    if (parallel) {
+        thread::worker_pool<uint_t,cache_reader_workspace_t> pool;
+        pool.start(opts.n_thread, do_block, nflux, fitter.batch_size);
+        pool.set_max_queued(4*opts.n_thread);
+
+        for (uint_t ib = 0; ib < cache.nblock && first_bad == npos; ++ib) {
+            pool.process(ib);
+        }
+
+        pool.join();
+    } else {
+        cache_reader_workspace_t ws(nflux, fitter.batch_size);
+        for (uint_t ib = 0; ib < cache.nblock && first_bad == npos; ++ib) {
+            do_block(ws, ib);
+        }
+    }
+
+    if (!mapped) {
+        cache.cache_file.close();
+    }
+
+    cache.unmap();
+
+    if (first_bad != npos) {
+        if (resume) {
+            // Rebuild from the first bad block
+            warning("block ", uint_t(first_bad), " of the cache file is corrupted, "
+                "the cache will be rebuilt from there");
+            cache.nblock = first_bad;
+        } else {
+            print("");
+            error("could not read data from cache file");
+            error("block ", uint_t(first_bad), " is corrupted, please remove the cache and try again");
+            print("");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+namespace {
+    using column_t = gridder_t::column_cache_t::column_t;
+
+    uint_t column_size(const column_t& c, uint_t nmodel) {
+        return sizeof(column_header_t) + sizeof(float)*nmodel*c.nvalue;
+    }
+
+    void unmap_column(column_t& c) {
+        if (c.map_data) {
+            ::munmap(c.map_data, c.map_size);
+        }
+
+        c.map_data = nullptr;
+        c.data = nullptr;
+        c.map_size = 0;
+        c.present = false;
+        c.writable = false;
+    }
+
+    bool map_column(column_t& c, uint_t nmodel) {
+        const uint_t size = column_size(c, nmodel);
+
+        int fd = ::open(c.filename.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || uint_t(st.st_size) != size) {
+            ::close(fd);
+            return false;
+        }
+
+        void* data = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd); // NB: the mapping remains valid
+        if (data == MAP_FAILED) return false;
+
+        c.map_data = static_cast<char*>(data);
+        c.map_size = size;
+        c.data = reinterpret_cast<float*>(c.map_data + sizeof(column_header_t));
+
+        column_header_t header;
+        std::memcpy(&header, c.map_data, sizeof(header));
+        std::string hash(header.hash, strnlen(header.hash, sizeof(header.hash)));
+
+        bool good = std::memcmp(header.magic, column_magic, sizeof(column_magic)) == 0 &&
+            header.version == column_version && header.complete == 1 &&
+            header.nmodel == nmodel && header.nvalue == c.nvalue && hash == c.hash &&
+            cache_checksum(c.map_data + sizeof(header), size - sizeof(header), checksum_init)
+                == header.checksum;
+
+        if (!good) {
+            unmap_column(c);
+            return false;
+        }
+
+        c.present = true;
+        return true;
+    }
+
+    // Write zeros over the whole file, so that all the blocks are allocated
+    bool fill_file(int fd, uint_t size) {
+        if (::ftruncate(fd, size) != 0) return false;
+
+        std::vector<char> zeros(std::min(size, uint_t(1) << 20), 0);
+        uint_t pos = 0;
+        while (pos < size) {
+            uint_t n = std::min(size - pos, uint_t(zeros.size()));
+            ssize_t nw = ::pwrite(fd, zeros.data(), n, pos);
+            if (nw < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+
+            pos += nw;
+        }
+
+        return true;
+    }
+
+    // Reserve 'size' bytes of disk space for a newly created file
+    bool reserve_file(int fd, uint_t size) {
+#if defined(F_PREALLOCATE)
+        // macOS: no posix_fallocate(), preallocate then set the file size
+        fstore_t store;
+        std::memset(&store, 0, sizeof(store));
+        store.fst_flags = F_ALLOCATECONTIG | F_ALLOCATEALL;
+        store.fst_posmode = F_PEOFPOSMODE;
+        store.fst_length = off_t(size);
+        if (::fcntl(fd, F_PREALLOCATE, &store) == -1) {
+            // NB: contiguous space may not be available, try again without
+            store.fst_flags = F_ALLOCATEALL;
+            if (::fcntl(fd, F_PREALLOCATE, &store) == -1) {
+                return fill_file(fd, size);
+            }
+        }
+
+        return ::ftruncate(fd, size) == 0;
+#elif defined(__linux__) || defined(__FreeBSD__) || defined(__NetBSD__)
+        int err = ::posix_fallocate(fd, 0, size);
+        if (err == EINVAL || err == EOPNOTSUPP) {
+            // NB: not supported by all file systems
+            return fill_file(fd, size);
+        }
+
+        return err == 0;
+#else
+        return fill_file(fd, size);
+#endif
+    }
+
+    bool create_column(column_t& c, uint_t nmodel) {
+        const uint_t size = column_size(c, nmodel);
+
+        int fd = ::open(c.filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+
+        // NB: reserve the disk space now, since running out of space while writing into
+        // the mapping would crash the program
+        if (!reserve_file(fd, size)) {
+            ::close(fd);
+            file::remove(c.filename);
+            return false;
+        }
+
+        void* data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            file::remove(c.filename);
+            return false;
+        }
+
+        c.map_data = static_cast<char*>(data);
+        c.map_size = size;
+        c.data = reinterpret_cast<float*>(c.map_data + sizeof(column_header_t));
+
+        column_header_t header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, column_magic, sizeof(column_magic));
+        header.version = column_version;
+        header.complete = 0;
+        header.nmodel = nmodel;
+        header.nvalue = c.nvalue;
+        std::memcpy(header.hash, c.hash.data(), std::min(c.hash.size(), sizeof(header.hash)));
+        std::memcpy(c.map_data, &header, sizeof(header));
+
+        c.writable = true;
+        return true;
+    }
+
+    void finish_column(column_t& c) {
+        column_header_t header;
+        std::memcpy(&header, c.map_data, sizeof(header));
+        header.checksum = cache_checksum(c.map_data + sizeof(header), c.map_size - sizeof(header),
+            checksum_init);
+        header.complete = 1;
+
+        // NB: the header is written last, so the column is only valid once the values are
+        // on the disk
+        ::msync(c.map_data, c.map_size, MS_SYNC);
+        std::memcpy(c.map_data, &header, sizeof(header));
+        ::msync(c.map_data, sizeof(header), MS_SYNC);
+
+        c.writable = false;
+        c.present = true;
+    }
+}
+
+void gridder_t::column_cache_t::init(const std::string& prefix, const std::string& grid_hash,
+    uint_t tnmodel, uint_t tnprop, const vec<1,fast_filter_t>& filters) {
+
+    nmodel = tnmodel;
+
+    // Photometric filters are identified by their ID, and spectral channels by their
+    // definition. The definition of the filter is also part of the column hash, so that the
+    // column is rebuilt if the filter changes.
+    flux.resize(filters.size());
+    for (uint_t il : range(filters)) {
+        const fast_filter_t& f = filters.safe[il];
+        std::string key = (f.spectral ? "S"+hash(f.wl, f.tr) : "F"+to_string(f.id));
+
+        flux.safe[il].filename = prefix+key+".col";
+        flux.safe[il].hash = hash(grid_hash, f.spectral, f.wl, f.tr);
+        flux.safe[il].nvalue = 1;
+    }
+
+    props.filename = prefix+"props.col";
+    props.hash = grid_hash;
+    props.nvalue = tnprop;
+}
+
+uint_t gridder_t::column_cache_t::check(bool verbose) {
+    uint_t nmissing = 0;
+    for (uint_t il : range(flux)) {
+        if (!map_column(flux.safe[il], nmodel)) {
+            ++nmissing;
+        }
+    }
+
+    if (!map_column(props, nmodel)) {
+        ++nmissing;
+    }
+
+    if (verbose) {
+        if (nmissing == 0) {
+            note("all the columns of the cache exist and seem valid, will use them");
+        } else {
+            note("found ", flux.size()+1-nmissing, " columns out of ", flux.size()+1,
+                " in the cache, will build the ", nmissing, " others");
+        }
+    }
+
+    return nmissing;
+}
+
+bool gridder_t::column_cache_t::complete() const {
+    if (!props.present) return false;
+
+    for (uint_t il : range(flux)) {
+        if (!flux.safe[il].present) return false;
+    }
+
+    return true;
+}
+
+bool gridder_t::column_cache_t::has_flux(uint_t il) const {
+    return !flux.empty() && flux.safe[il].present;
+}
+
+bool gridder_t::column_cache_t::open_write() {
+    nwritten = 0;
+
+    bool good = true;
+    for (uint_t il : range(flux)) {
+        if (!flux.safe[il].present && !create_column(flux.safe[il], nmodel)) {
+            good = false;
+            break;
+        }
+    }
+
+    if (good && !props.present && !create_column(props, nmodel)) {
+        good = false;
+    }
+
+    if (!good) {
+        // Do not leave partial columns behind
+        auto discard = [](column_t& c) {
+            if (!c.writable) return;
+            unmap_column(c);
+            file::remove(c.filename);
+        };
+
+        for (uint_t il : range(flux)) {
+            discard(flux.safe[il]);
+        }
+
+        discard(props);
+    }
+
+    return good;
+}
+
+bool gridder_t::column_cache_t::writing() const {
+    if (props.writable) return true;
+
+    for (uint_t il : range(flux)) {
+        if (flux.safe[il].writable) return true;
+    }
+
+    return false;
+}
+
+void gridder_t::column_cache_t::write_model(const model_t& model, uint_t pos) {
+    // NB: each model has its own place in the columns, no need to lock
+    for (uint_t il : range(flux)) {
+        column_t& c = flux.safe[il];
+        if (c.writable) {
+            c.data[pos] = model.flux.safe[il];
+        }
+    }
+
+    if (props.writable) {
+        std::memcpy(props.data + pos*props.nvalue, model.props.data.data(),
+            sizeof(float)*props.nvalue);
+    }
+
+    ++nwritten;
+}
+
+void gridder_t::column_cache_t::close_write() {
+    if (!writing()) return;
+
+    // Only validate the new columns if all the models were written
+    const bool good = (nwritten == nmodel);
+    if (!good) {
+        warning("only ", uint_t(nwritten), " models out of ", nmodel, " were written in the "
+            "cache, the new columns will not be saved");
+    }
+
+    auto finish = [&](column_t& c) {
+        if (!c.writable) return;
+
+        if (good) {
+            finish_column(c);
+        } else {
+            unmap_column(c);
+            file::remove(c.filename);
+        }
+    };
+
+    for (uint_t il : range(flux)) {
+        finish(flux.safe[il]);
+    }
+
+    finish(props);
+}
+
+gridder_t::column_cache_t::~column_cache_t() {
+    // NB: columns which were not closed are left incomplete, and will be rebuilt next time
+    for (uint_t il : range(flux)) {
+        unmap_column(flux.safe[il]);
+    }
+
+    unmap_column(props);
+}
+
+bool gridder_t::read_and_send_columns(fitter_t& fitter) {
+    const uint_t nflux = columns.flux.size();
+    const uint_t chunk_size = 4096;
+    const uint_t nchunk = (nmodel + chunk_size - 1)/chunk_size;
+    const bool parallel = opts.parallel == parallel_choice::generators && opts.n_thread > 1;
+
+    auto pg = progress_start(nmodel);
+    auto do_chunk = [&](cache_reader_workspace_t& ws, uint_t& ic) {
+        const uint_t i0 = ic*chunk_size;
+        const uint_t i1 = std::min(i0 + chunk_size, nmodel);
+
+        // Position of the models in the columns, see model_valid
+        uint_t ipos = model_valid.rank(i0);
+
+        uint_t nm = 0;
+        for (uint_t igrid = i0; igrid < i1; ++igrid) {
+            if (!model_valid.get(igrid)) continue;
+
+            const uint_t pos = ipos;
+            ++ipos;
+
+            if (!model_mask.empty() && !model_mask.get(igrid)) continue;
+
+            // Assemble the model from the columns
+            // NB: properties are used in place, only the fluxes need to be gathered
+            model_view_t& model = ws.models.safe[nm];
+            model.igrid = igrid;
+            model.props = columns.props.data + pos*nprop;
+            for (uint_t il : range(nflux)) {
+                ws.flux.safe(nm,il) = columns.flux.safe[il].data[pos];
+            }
+
+            model.flux = &ws.flux.safe(nm,0);
+
+            ++nm;
+            if (nm == ws.models.size()) {
+                fitter.fit(ws.models.data.data(), nm);
+                nm = 0;
+            }
+        }
+
+        if (nm > 0) {
+            fitter.fit(ws.models.data.data(), nm);
+        }
+
+        if (opts.verbose) {
+            auto lock = (parallel ?
+                std::unique_lock<std::mutex>(progress_mutex) : std::unique_lock<std::mutex>());
+
+            for (uint_t i = i0; i < i1; ++i) {
+                progress_tick(pg, 0.5);
+            }
+        }
+    };
+
+    if (parallel) {
+        thread::worker_pool<uint_t,cache_reader_workspace_t> pool;
+        pool.start(opts.n_thread, do_chunk, nflux, fitter.batch_size);
+        pool.set_max_queued(4*opts.n_thread);
+
+        for (uint_t ic : range(nchunk)) {
+            pool.process(ic);
+        }
+
+        pool.join();
+    } else {
+        cache_reader_workspace_t ws(nflux, fitter.batch_size);
+        for (uint_t ic : range(nchunk)) {
+            do_chunk(ws, ic);
+        }
+    }
+
+    return true;
+}
+
+namespace {
+    // IEEE 754 half precision, with rounding to nearest even
+    std::uint16_t float_to_half(float f) {
+        std::uint32_t x;
+        std::memcpy(&x, &f, sizeof(x));
+
+        std::uint16_t sign = (x >> 16) & 0x8000;
+        std::int32_t exp = std::int32_t((x >> 23) & 0xff) - 127 + 15;
+        std::uint32_t mant = x & 0x7fffff;
+
+        if (exp >= 31) {
+            // Too large, or not finite
+            return sign | 0x7c00;
+        } else if (exp <= 0) {
+            // Sub-normal, or too small
+            if (exp < -10) return sign;
+
+            mant |= 0x800000;
+            std::uint32_t shift = 14 - exp;
+            std::uint32_t h = mant >> shift;
+            std::uint32_t rem = mant & ((1u << shift) - 1);
+            std::uint32_t mid = 1u << (shift - 1);
+            if (rem > mid || (rem == mid && (h & 1))) ++h;
+
+            return sign | h;
+        } else {
+            // NB: rounding may carry over to the exponent, which is the correct result
+            std::uint32_t h = (std::uint32_t(exp) << 10) | (mant >> 13);
+            std::uint32_t rem = mant & 0x1fff;
+            if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) ++h;
+
+            return sign | h;
+        }
+    }
+
+    float half_to_float(std::uint16_t h) {
+        std::uint32_t sign = std::uint32_t(h & 0x8000) << 16;
+        std::uint32_t exp = (h >> 10) & 0x1f;
+        std::uint32_t mant = h & 0x3ff;
+
+        if (exp == 0) {
+            // Zero or sub-normal
+            float f = std::ldexp(float(mant), -24);
+            return sign ? -f : f;
+        }
+
+        std::uint32_t x;
+        if (exp == 31) {
+            x = sign | 0x7f800000 | (mant << 13);
+        } else {
+            x = sign | ((exp - 15 + 127) << 23) | (mant << 13);
+        }
+
+        float f;
+        std::memcpy(&f, &x, sizeof(f));
+        return f;
+    }
+}
+
+uint_t gridder_t::sed_cache_t::record_size() const {
+    uint_t size = sizeof(std::uint64_t) + sizeof(float)*(1 + nvalue) +
+        sizeof(std::uint16_t)*nlam;
+    return 8*((size + 7)/8);
+}
+
+bool gridder_t::sed_cache_t::open(const std::string& fname, const std::string& hash,
+    uint_t tnrecord, uint_t tnlam, uint_t tnvalue) {
+
+    filename = fname;
+    nrecord = tnrecord;
+    nlam = tnlam;
+    nvalue = tnvalue;
+
+    const uint_t size = sizeof(sed_header_t) + nrecord*record_size();
+
+    sed_header_t header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, sed_magic, sizeof(sed_magic));
+    header.version = sed_version;
+    header.nlam = nlam;
+    header.nvalue = nvalue;
+    header.nrecord = nrecord;
+    std::memcpy(header.hash, hash.data(), std::min(hash.size(), sizeof(header.hash)));
+
+    // Re-use the existing file if it matches this library and grid
+    int fd = ::open(filename.c_str(), O_RDWR);
+    if (fd >= 0) {
+        struct stat st;
+        sed_header_t fheader;
+        bool good = ::fstat(fd, &st) == 0 && uint_t(st.st_size) == size &&
+            ::pread(fd, &fheader, sizeof(fheader), 0) == ssize_t(sizeof(fheader)) &&
+            std::memcmp(&fheader, &header, sizeof(header)) == 0;
+
+        if (!good) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+
+    if (fd < 0) {
+        // Create a new file, with all records invalid
+        fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+
+        // NB: reserve the disk space now, since running out of space while writing into
+        // the mapping would crash the program
+        if (!reserve_file(fd, size) ||
+            ::pwrite(fd, &header, sizeof(header), 0) != ssize_t(sizeof(header))) {
+            ::close(fd);
+            file::remove(filename);
+            return false;
+        }
+    }
+
+    void* data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd); // NB: the mapping remains valid
+    if (data == MAP_FAILED) return false;
+
+    map_data = static_cast<char*>(data);
+    map_size = size;
+
+    return true;
+}
+
+bool gridder_t::sed_cache_t::valid(uint_t ir) const {
+    const char* p = map_data + sizeof(sed_header_t) + ir*record_size();
+
+    std::uint64_t checksum;
+    std::memcpy(&checksum, p, sizeof(checksum));
+
+    return cache_checksum(p + sizeof(checksum), record_size() - sizeof(checksum),
+        checksum_init) == checksum;
+}
+
+void gridder_t::sed_cache_t::read(uint_t ir, vec1d& sed, vec1f& values) const {
+    const char* p = map_data + sizeof(sed_header_t) + ir*record_size() + sizeof(std::uint64_t);
+
+    float scale;
+    std::memcpy(&scale, p, sizeof(scale));
+    p += sizeof(scale);
+
+    values.resize(nvalue);
+    std::memcpy(values.data.data(), p, sizeof(float)*nvalue);
+    p += sizeof(float)*nvalue;
+
+    sed.resize(nlam);
+    for (uint_t il : range(nlam)) {
+        std::uint16_t h;
+        std::memcpy(&h, p + sizeof(h)*il, sizeof(h));
+        sed.safe[il] = scale*half_to_float(h);
+    }
+}
+
+void gridder_t::sed_cache_t::write(uint_t ir, const vec1d& sed, const vec1f& values) {
+    char* beg = map_data + sizeof(sed_header_t) + ir*record_size();
+    char* p = beg + sizeof(std::uint64_t);
+
+    // Scale the SED by a power of two, so that its maximum is close to the largest value
+    // allowed in half precision: values down to 2e-9 times the maximum are then stored with
+    // a relative precision of 5e-4
+    double smax = 0.0;
+    for (uint_t il : range(nlam)) {
+        if (std::abs(sed.safe[il]) > smax) smax = std::abs(sed.safe[il]);
+    }
+
+    int e = 0;
+    if (smax > 0.0 && is_finite(smax)) {
+        std::frexp(smax, &e);
+    }
+
+    float scale = std::ldexp(1.0f, e - 15);
+    std::memcpy(p, &scale, sizeof(scale));
+    p += sizeof(scale);
+
+    std::memcpy(p, values.data.data(), sizeof(float)*nvalue);
+    p += sizeof(float)*nvalue;
+
+    for (uint_t il : range(nlam)) {
+        std::uint16_t h = float_to_half(sed.safe[il]/scale);
+        std::memcpy(p + sizeof(h)*il, &h, sizeof(h));
+    }
+
+    p += sizeof(std::uint16_t)*nlam;
+    std::memset(p, 0, beg + record_size() - p);
+
+    // NB: the checksum is written last, the record is invalid until then
+    std::uint64_t checksum = cache_checksum(beg + sizeof(checksum),
+        record_size() - sizeof(checksum), checksum_init);
+    std::memcpy(beg, &checksum, sizeof(checksum));
+}
+
+gridder_t::sed_cache_t::~sed_cache_t() {
+    if (map_data) {
+        ::munmap(map_data, map_size);
+    }
+}
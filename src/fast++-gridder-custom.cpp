@@ -67,6 +67,173 @@ double gridder_t::tinyexpr_wrapper::eval() {
     return te_eval(expr);
 }
 
+// Evaluating the expression tree once for each value of the first variable is slow for long
+// arrays, since each evaluation walks the whole tree. Instead, the tree is flattened into a
+// list of steps (arguments first), and each step is applied to the whole array at once.
+// Sub-trees which do not depend on the first variable are evaluated once per call.
+struct gridder_t::tinyexpr_wrapper::batch_program_t {
+    enum step_type : uint_t { constant, variable, function, closure };
+
+    struct step_t {
+        const te_expr* node = nullptr;
+        step_type type = constant;
+        uint_t arity = 0;
+        std::array<uint_t,3> args;
+    };
+
+    const double* var = nullptr;
+    std::vector<step_t> steps;
+    vec<1,vec1d> reg;           // [nstep] values of each step
+    vec1d scalar;               // [nstep] values of constant steps
+    bool good = true;
+
+    // NB: these are the internals of tinyexpr (see tinyexpr.c)
+    static int type_mask(int t) {
+        return t & 0x0000001F;
+    }
+
+    static uint_t arity_of(int t) {
+        return (t & (TE_FUNCTION0 | TE_CLOSURE0)) ? (t & 0x00000007) : 0;
+    }
+
+    bool depends(const te_expr* n) const {
+        int t = type_mask(n->type);
+        if (t == TE_VARIABLE) {
+            return n->bound == var;
+        } else if (t >= TE_FUNCTION0) {
+            for (uint_t i : range(arity_of(n->type))) {
+                if (depends(static_cast<const te_expr*>(n->parameters[i]))) {
+                    return true;
+                }
+            }
+        }
+
+        return false;
+    }
+
+    uint_t add(const te_expr* n) {
+        step_t s;
+        s.node = n;
+
+        int t = type_mask(n->type);
+        if (!depends(n)) {
+            s.type = constant;
+        } else if (t == TE_VARIABLE) {
+            s.type = variable;
+        } else {
+            s.type = (t >= TE_CLOSURE0 ? closure : function);
+            s.arity = arity_of(n->type);
+            if (s.arity > s.args.size()) {
+                // Not supported, will use the slow path
+                good = false;
+                s.arity = 0;
+            }
+
+            for (uint_t i : range(s.arity)) {
+                s.args[i] = add(static_cast<const te_expr*>(n->parameters[i]));
+            }
+        }
+
+        steps.push_back(s);
+        return steps.size()-1;
+    }
+
+    void run(const vec1d& x, vec1d& res) {
+        uint_t nx = x.size();
+        reg.resize(steps.size());
+        scalar.resize(steps.size());
+
+        const double* a[3];
+        uint_t da[3];
+
+        for (uint_t k : range(steps)) {
+            const step_t& s = steps[k];
+            if (s.type == constant) {
+                scalar.safe[k] = te_eval(s.node);
+                continue;
+            } else if (s.type == variable) {
+                continue;
+            }
+
+            // Arguments are either arrays or constants
+            for (uint_t i : range(s.arity)) {
+                const step_t& sa = steps[s.args[i]];
+                if (sa.type == constant) {
+                    a[i] = &scalar.safe[s.args[i]];
+                    da[i] = 0;
+                } else if (sa.type == variable) {
+                    a[i] = x.data.data();
+                    da[i] = 1;
+                } else {
+                    a[i] = reg.safe[s.args[i]].data.data();
+                    da[i] = 1;
+                }
+            }
+
+            vec1d& r = reg.safe[k];
+            r.resize(nx);
+
+            const void* f = s.node->function;
+            void* ctx = (s.type == closure ? s.node->parameters[s.arity] : nullptr);
+
+            using f0 = double(*)();
+            using f1 = double(*)(double);
+            using f2 = double(*)(double,double);
+            using f3 = double(*)(double,double,double);
+            using c0 = double(*)(void*);
+            using c1 = double(*)(void*,double);
+            using c2 = double(*)(void*,double,double);
+            using c3 = double(*)(void*,double,double,double);
+
+            if (s.type == function) {
+                switch (s.arity) {
+                case 0: for (uint_t i = 0; i < nx; ++i) r.safe[i] = ((f0)f)(); break;
+                case 1: for (uint_t i = 0; i < nx; ++i) r.safe[i] = ((f1)f)(a[0][i*da[0]]); break;
+                case 2: for (uint_t i = 0; i < nx; ++i) r.safe[i] = ((f2)f)(a[0][i*da[0]], a[1][i*da[1]]); break;
+                case 3: for (uint_t i = 0; i < nx; ++i) r.safe[i] = ((f3)f)(a[0][i*da[0]], a[1][i*da[1]], a[2][i*da[2]]); break;
+                }
+            } else {
+                switch (s.arity) {
+                case 0: for (uint_t i = 0; i < nx; ++i) r.safe[i] = ((c0)f)(ctx); break;
+                case 1: for (uint_t i = 0; i < nx; ++i) r.safe[i] = ((c1)f)(ctx, a[0][i*da[0]]); break;
+                case 2: for (uint_t i = 0; i < nx; ++i) r.safe[i] = ((c2)f)(ctx, a[0][i*da[0]], a[1][i*da[1]]); break;
+                case 3: for (uint_t i = 0; i < nx; ++i) r.safe[i] = ((c3)f)(ctx, a[0][i*da[0]], a[1][i*da[1]], a[2][i*da[2]]); break;
+                }
+            }
+        }
+
+        // The last step is the root of the tree
+        const step_t& s = steps.back();
+        res.resize(nx);
+        if (s.type == constant) {
+            res[_] = scalar.back();
+        } else if (s.type == variable) {
+            res[_] = x;
+        } else {
+            res[_] = reg.back();
+        }
+    }
+};
+
+void gridder_t::tinyexpr_wrapper::eval_batch(const vec1d& x, vec1d& res) {
+    if (!batch) {
+        batch.reset(new batch_program_t());
+        batch->var = &vars[0];
+        batch->add(expr);
+    }
+
+    if (batch->good) {
+        batch->run(x, res);
+    } else {
+        // Slow path
+        res.resize(x.size());
+        for (uint_t i : range(x)) {
+            vars[0] = x.safe[i];
+            res.safe[i] = te_eval(expr);
+        }
+    }
+}
+
 gridder_t::tinyexpr_wrapper::~tinyexpr_wrapper() {
     if (expr != nullptr) {
         te_free(expr);
@@ -80,42 +247,369 @@ std::string gridder_t::get_library_file_ssp(uint_t im) const {
         "_z"+replace(to_string(output.grid[grid_id::metal][im]), "0.", "");
 }
 
+bool gridder_t::compile_sfh_custom(tinyexpr_wrapper& expr) const {
+    vec1s p = {"t", "lage"};
+    append(p, opts.custom_params);
+
+    return expr.compile(opts.custom_sfh, p);
+}
+
 void gridder_t::evaluate_sfh_custom(const vec1u& idm, const vec1d& t, vec1d& sfh) const {
-    sfh_expr.vars[1] = output.grid[grid_id::age][idm[grid_id::age]];
+    evaluate_sfh_custom(sfh_expr, idm, t, sfh);
+}
+
+void gridder_t::evaluate_sfh_custom(tinyexpr_wrapper& expr, const vec1u& idm, const vec1d& t,
+    vec1d& sfh) const {
+
+    expr.vars[1] = output.grid[grid_id::age][idm[grid_id::age]];
     for (uint_t i : range(opts.custom_params)) {
-        sfh_expr.vars[i+2] = output.grid[grid_id::custom+i][idm[grid_id::custom+i]];
+        expr.vars[i+2] = output.grid[grid_id::custom+i][idm[grid_id::custom+i]];
     }
 
-    sfh.resize(t.size());
-    double nage = e10(output.grid[grid_id::age][idm[grid_id::age]]);
-    for (uint_t i : range(t)) {
-        sfh_expr.vars[0] = (opts.custom_sfh_lookback ? t.safe[i] : nage - t.safe[i]);
-        sfh.safe[i] = sfh_expr.eval();
+    if (opts.custom_sfh_lookback) {
+        expr.eval_batch(t, sfh);
+    } else {
+        double nage = e10(output.grid[grid_id::age][idm[grid_id::age]]);
+        expr.xbuf.resize(t.size());
+        for (uint_t i : range(t)) {
+            expr.xbuf.safe[i] = nage - t.safe[i];
+        }
+
+        expr.eval_batch(expr.xbuf, sfh);
     }
 }
 
-bool gridder_t::build_and_send_custom(fitter_t& fitter) {
-    model_id_pair m;
-    m.model.flux.resize(input.lambda.size());
-    m.model.props.resize(nprop);
-    m.idm.resize(nparam);
+void gridder_t::sample_sfh_custom(tinyexpr_wrapper& expr, const vec1u& idm, const ssp_bc03& ssp,
+    vec1d& ltime, vec1d& sfh) const {
 
-    ssp_bc03 ssp;
+    const double dt = opts.custom_sfh_step;
+    const double nage = e10(output.grid[grid_id::age][idm[grid_id::age]]);
+
+    if (!opts.custom_sfh_adaptive) {
+        // Compute lookback time (t=0 is when the galaxy is observed, t>0 is in the past) in [yr]
+        ltime.resize(uint_t(ceil(nage/dt)+1.0));
+        for (uint_t i : range(ltime)) {
+            ltime.safe[i] = dt*i;
+        }
+
+        evaluate_sfh_custom(expr, idm, ltime, sfh);
+        return;
+    }
+
+    // Adaptive time grid
+    // Start from the edges of the SSP age bins, which are dense where the spectra evolve
+    // quickly, and a coarse uniform grid to catch features in old populations
+    const uint_t ncoarse = 256;
+    const double tcoarse = max(dt, nage/ncoarse);
+    vec1d tseed;
+    tseed.reserve(ssp.age.size() + ncoarse + 3);
+    tseed.push_back(0.0);
+    tseed.push_back(nage);
+    for (uint_t it : range(1, ssp.age.size())) {
+        double t = 0.5*(ssp.age.safe[it-1] + ssp.age.safe[it]);
+        if (t >= nage) break;
+        tseed.push_back(t);
+    }
+    for (double t = tcoarse; t < nage; t += tcoarse) {
+        tseed.push_back(t);
+    }
+    if (opts.sfr_avg > 0 && opts.sfr_avg < nage) {
+        tseed.push_back(opts.sfr_avg);
+    }
+
+    inplace_sort(tseed);
+    ltime.clear();
+    for (uint_t i : range(tseed)) {
+        if (ltime.empty() || tseed.safe[i] - ltime.back() > 0.01*dt) {
+            ltime.push_back(tseed.safe[i]);
+        }
+    }
+
+    if (ltime.size() == 1) {
+        // Galaxy younger than the time step
+        ltime.push_back(nage);
+    }
+
+    evaluate_sfh_custom(expr, idm, ltime, sfh);
+
+    // Then bisect intervals until the trapezoid rule converges. The error on each interval
+    // is estimated from the difference with the bisected interval, and must be smaller than
+    // CUSTOM_SFH_TOL times the total mass formed, prorated to the interval's length.
+    // Intervals are never split below the uniform step CUSTOM_SFH_STEP, hence the result
+    // converges to the uniform grid as the tolerance decreases.
+    vec1b refine = replicate(true, ltime.size()-1);
+    vec1u isplit;
+    vec1d tmid, smid, tltime, tsfh;
+    vec1b trefine;
+    while (true) {
+        isplit.clear();
+        tmid.clear();
+        for (uint_t i : range(refine)) {
+            if (refine.safe[i] && ltime.safe[i+1] - ltime.safe[i] > 2*dt) {
+                isplit.push_back(i);
+                tmid.push_back(0.5*(ltime.safe[i] + ltime.safe[i+1]));
+            }
+        }
+
+        if (isplit.empty()) break;
+
+        evaluate_sfh_custom(expr, idm, tmid, smid);
+
+        double tol = opts.custom_sfh_tol*integrate(ltime, sfh)/nage;
+
+        tltime.resize(ltime.size() + isplit.size());
+        tsfh.resize(tltime.size());
+        trefine.resize(tltime.size()-1);
+
+        uint_t j = 0, k = 0;
+        for (uint_t i : range(refine)) {
+            tltime.safe[j] = ltime.safe[i];
+            tsfh.safe[j] = sfh.safe[i];
+
+            if (k < isplit.size() && isplit.safe[k] == i) {
+                double w = ltime.safe[i+1] - ltime.safe[i];
+                double err = 0.25*w*std::abs(sfh.safe[i] + sfh.safe[i+1] - 2*smid.safe[k]);
+                bool bad = !(err <= tol*w);
+
+                trefine.safe[j] = bad;
+                ++j;
+                tltime.safe[j] = tmid.safe[k];
+                tsfh.safe[j] = smid.safe[k];
+                trefine.safe[j] = bad;
+                ++k;
+            } else {
+                trefine.safe[j] = false;
+            }
 
+            ++j;
+        }
+
+        tltime.safe[j] = ltime.back();
+        tsfh.safe[j] = sfh.back();
+
+        std::swap(ltime, tltime);
+        std::swap(sfh, tsfh);
+        std::swap(refine, trefine);
+    }
+}
+
+namespace sfh_kernels {
+    // Closed-form SFHs, as a function of the time 'x' since the onset of star formation [yr]
+    // and of the time scale 'tau' [yr]; formed(a,b,tau) is the integral of sfr(x,tau) from a to b
+    struct exponential {
+        static double sfr(double x, double tau) {
+            return exp(-x/tau);
+        }
+        static double formed(double a, double b, double tau) {
+            return tau*(exp(-a/tau) - exp(-b/tau));
+        }
+    };
+
+    struct delayed {
+        static double sfr(double x, double tau) {
+            return (x/tau)*exp(-x/tau);
+        }
+        static double formed(double a, double b, double tau) {
+            return tau*(exp(-a/tau)*(1.0 + a/tau) - exp(-b/tau)*(1.0 + b/tau));
+        }
+    };
+
+    struct truncated {
+        static double sfr(double x, double tau) {
+            return (x <= tau ? 1.0 : 0.0);
+        }
+        static double formed(double a, double b, double tau) {
+            return max(0.0, min(b, tau) - min(a, tau));
+        }
+    };
+
+    struct constant {
+        static double sfr(double, double) {
+            return 1.0;
+        }
+        static double formed(double a, double b, double) {
+            return b - a;
+        }
+    };
+
+    double sfr(sfh_kind kind, double x, double tau) {
+        switch (kind) {
+        case sfh_kind::exponential : return exponential::sfr(x, tau);
+        case sfh_kind::delayed :     return delayed::sfr(x, tau);
+        case sfh_kind::truncated :   return truncated::sfr(x, tau);
+        case sfh_kind::constant :    return constant::sfr(x, tau);
+        default :                    return dnan;
+        }
+    }
+
+    // Mass formed in each SSP age bin and SFR for a galaxy of a given 'age' [yr]
+    template<typename K>
+    double integrate(const ssp_bc03& ssp, double age, double tau, double sfr_avg,
+        vec1d& formed) {
+
+        formed.resize(ssp.age.size());
+        formed[_] = 0.0;
+
+        // NB: SSP bins are in lookback time
+        ssp.integrate_analytic(age, [&](double t1, double t2) {
+            return K::formed(age - t2, age - t1, tau);
+        }, [&](uint_t it, double f) {
+            formed.safe[it] = f;
+        });
+
+        if (sfr_avg > 0) {
+            // Average SFR over the past X yr
+            return K::formed(age - min(sfr_avg, age), age, tau)/sfr_avg;
+        } else {
+            // Use instantaneous SFR
+            return K::sfr(age, tau);
+        }
+    }
+}
+
+double gridder_t::sfh_closed_form(const vec1u& idm, const ssp_bc03& ssp, vec1d& formed) const {
+    double age = e10(output.grid[grid_id::age][idm[grid_id::age]]);
+    double tau = 1.0;
+    if (custom_tau_param != npos) {
+        uint_t ip = grid_id::custom+custom_tau_param;
+        tau = e10(output.grid[ip][idm[ip]]);
+    }
+
+    switch (opts.custom_sfh_kind) {
+    case sfh_kind::exponential :
+        return sfh_kernels::integrate<sfh_kernels::exponential>(ssp, age, tau, opts.sfr_avg, formed);
+    case sfh_kind::delayed :
+        return sfh_kernels::integrate<sfh_kernels::delayed>(ssp, age, tau, opts.sfr_avg, formed);
+    case sfh_kind::truncated :
+        return sfh_kernels::integrate<sfh_kernels::truncated>(ssp, age, tau, opts.sfr_avg, formed);
+    case sfh_kind::constant :
+        return sfh_kernels::integrate<sfh_kernels::constant>(ssp, age, tau, opts.sfr_avg, formed);
+    default :
+        return dnan;
+    }
+}
+
+bool gridder_t::check_sfh_closed_form() const {
+    const vec1f& output_age = output.grid[grid_id::age];
+
+    // Sample the SFH of each model and compare it to the closed form
+    const uint_t nsample = 32;
+    vec1d ltime(nsample), sfh, ref(nsample);
+    vec1u idm(nparam);
+    for (uint_t ic = 0; ic < ncustom; ++ic) {
+        double tau = 1.0;
+        if (custom_tau_param != npos) {
+            uint_t ip = grid_id::custom+custom_tau_param;
+            tau = e10(output.grid[ip][idm[ip]]);
+        }
+
+        for (uint_t ia : range(output_age)) {
+            idm[grid_id::age] = ia;
+            double age = e10(output_age[ia]);
+            for (uint_t i : range(nsample)) {
+                ltime.safe[i] = age*(i + 0.5)/nsample;
+                ref.safe[i] = sfh_kernels::sfr(opts.custom_sfh_kind, age - ltime.safe[i], tau);
+            }
+
+            evaluate_sfh_custom(idm, ltime, sfh);
+
+            double tol = 1e-4*max(abs(ref));
+            if (count(!(abs(sfh - ref) <= tol)) != 0) {
+                std::string pars = "lage="+to_string(output_age[ia]);
+                for (uint_t i : range(opts.custom_params)) {
+                    pars += ", "+opts.custom_params[i]+"="+
+                        to_string(output.grid[grid_id::custom+i][idm[grid_id::custom+i]]);
+                }
+
+                error("the CUSTOM_SFH expression does not match CUSTOM_SFH_KIND");
+                note("first difference found for ", pars);
+                note("either fix the expression, or leave CUSTOM_SFH empty to use the default one");
+                return false;
+            }
+        }
+
+        // Go to next model
+        idm[grid_id::age] = 0;
+        increment_index_list(idm, grid_dims);
+    }
+
+    return true;
+}
+
+bool gridder_t::build_and_send_custom(fitter_t& fitter) {
     const vec1f& output_metal = output.grid[grid_id::metal];
     const vec1f& output_age = output.grid[grid_id::age];
     const vec1f& output_z = output.grid[grid_id::z];
     const vec1f& output_av = output.grid[grid_id::av];
 
+    // SSP library, and pre-computed quantities shared by all the models built from it
+    struct library_t {
+        uint_t im = 0;
+        ssp_bc03 ssp;
+        vec1d lambda;     // [nlam] wavelengths used to build models
+        vec2d bol_corr;
+        vec2d ssp_props;  // [nssp,3+nav] mass, 1 (formed mass), bolometric corrections
+        vec2d dust_law;
+        std::shared_ptr<const filter_integrator_t> fint;
+
+        // With SED_CACHE, the SSPs are kept on their full wavelength grid
+        vec1u lkeep;      // [nlam] wavelengths used to build models
+        vec2d bol_weight; // [1+nav,nlam_full] see build_bolometric_weights()
+        std::unique_ptr<sed_cache_t> sed_cache;
+    };
+
+    // Model to build: the library it comes from, and its grid ID (with z = av = 0)
+    struct model_task_t {
+        std::shared_ptr<const library_t> lib;
+        uint_t igrid = npos;
+        uint_t ic = 0;    // ID of the custom parameter combination
+    };
+
     auto pg = progress_start(nmodel);
+
+    // List the libraries to read
+    vec1u lib_im;
     for (uint_t im : range(output_metal)) {
-        m.idm[_] = 0;
-        m.idm[grid_id::metal] = im;
+        if (!model_mask.empty()) {
+            // Skip this SSP if none of its models are needed
+            vec1u tidm = replicate(npos, grid_dims.size());
+            tidm[grid_id::metal] = im;
+            if (!mask_has_any(tidm)) {
+                skip_models(pg, nmodel/output_metal.size());
+                continue;
+            }
+        }
+
+        lib_im.push_back(im);
+    }
+
+    // SED cache: the SEDs depend on the library, the SFH and the velocity dispersion, but
+    // not on the dust, redshifts, filters or cosmology
+    const bool full_sed = opts.sed_cache;
+    const uint_t nsfhq = input.sfh_quant.size();
+    std::string sed_hash;
+    if (full_sed) {
+        sed_hash = hash(output.grid[grid_id::age],
+            output.grid[grid_id::custom+indgen(nparam-grid_id::custom)], opts.custom_sfh,
+            uint_t(opts.custom_sfh_kind), opts.custom_sfh_step, opts.custom_sfh_adaptive,
+            opts.custom_sfh_tol, opts.custom_sfh_lookback, opts.sfr_avg, opts.apply_vdisp);
+
+        for (uint_t i : range(input.sfh_quant)) {
+            auto& q = input.sfh_quant[i];
+            sed_hash = hash(sed_hash, q.name, uint_t(q.type), q.param);
+        }
+    }
+
+    // Function to read a library and prepare it for building models
+    auto load_library = [&](uint_t il, std::shared_ptr<const library_t> prev) {
+        std::shared_ptr<library_t> lib(new library_t());
+        lib->im = lib_im[il];
+        ssp_bc03& ssp = lib->ssp;
 
         // Load SSP
-        std::string filename = get_library_file_ssp(im);
+        std::string filename = get_library_file_ssp(lib->im);
         if (!ssp.read(filename)) {
-            return false;
+            return std::shared_ptr<const library_t>();
         }
 
         // Apply velocity dispersion
@@ -123,103 +617,307 @@ bool gridder_t::build_and_send_custom(fitter_t& fitter) {
             ssp.sed = convolve_vdisp(ssp.lambda, ssp.sed, opts.apply_vdisp);
         }
 
-        // Pre-compute dust law & IGM absorption (they don't change with SFH)
-        vec2d dust_law = build_dust_law(output_av, ssp.lambda);
-        vec2d igm_abs;
-        if (!opts.no_igm) {
-            igm_abs = build_igm_absorption(output_z, ssp.lambda);
+        // Only keep the wavelengths that are needed, and correct bolometric luminosities
+        // for the rest
+        vec1u lkeep = build_wavelength_selection(ssp.lambda);
+        if (full_sed) {
+            // The cached SEDs must not depend on the filters and redshifts, so the SSPs are
+            // kept on their full wavelength grid, and the bolometric corrections are computed
+            // from the SED of each model
+            lib->lkeep = lkeep;
+            lib->bol_weight = build_bolometric_weights(ssp.lambda, lkeep,
+                build_dust_law(output_av, ssp.lambda));
+            lib->lambda = ssp.lambda[lkeep];
+
+            std::string sed_filename = opts.output_dir+opts.library+"_"+opts.resolution+"_"+
+                opts.name_imf+"_"+opts.name_sfh+"_"+hash(sed_hash, filename)+".sed";
+
+            lib->sed_cache.reset(new sed_cache_t());
+            if (!lib->sed_cache->open(sed_filename, sed_hash, ncustom*output_age.size(),
+                ssp.lambda.size(), 3+nsfhq)) {
+                warning("could not open the SED cache file '", sed_filename, "'");
+                warning("the program will not use the SED cache for this library");
+                lib->sed_cache.reset();
+            }
+        } else {
+            lib->bol_corr = build_bolometric_correction(ssp.lambda, ssp.sed, lkeep,
+                build_dust_law(output_av, ssp.lambda));
+            ssp.lambda = vec1d(ssp.lambda[lkeep]);
+            ssp.sed = vec2d(ssp.sed(_,lkeep));
+            lib->lambda = ssp.lambda;
         }
 
-        // Function to build a model
-        auto do_model = [&](model_id_pair& tm) {
-            float& model_mass  = tm.model.props[prop_id::mass];
-            float& model_mform = tm.model.props[prop_id::mform];
-            float& model_sfr   = tm.model.props[prop_id::sfr];
-            float& model_ssfr  = tm.model.props[prop_id::ssfr];
+        // Quantities to sum along with the SEDs
+        lib->ssp_props.resize(ssp.age.size(), 2+lib->bol_corr.dims[1]);
+        for (uint_t it : range(ssp.age)) {
+            lib->ssp_props.safe(it,0) = ssp.mass.safe[it];
+            lib->ssp_props.safe(it,1) = 1.0;
+            for (uint_t i : range(lib->bol_corr.dims[1])) {
+                lib->ssp_props.safe(it,2+i) = lib->bol_corr.safe(it,i);
+            }
+        }
 
-            uint_t ia = tm.idm[grid_id::age];
+        // Pre-compute dust law & filter integration (they don't change with SFH)
+        lib->dust_law = build_dust_law(output_av, lib->lambda);
+
+        // NB: filter integration is only re-computed when the wavelength grid changes
+        if (prev && prev->fint->lambda.size() == lib->lambda.size() &&
+            count(prev->fint->lambda != lib->lambda) == 0) {
+            lib->fint = prev->fint;
+        } else {
+            std::shared_ptr<filter_integrator_t> fint(new filter_integrator_t());
+            update_filter_integrator(lib->lambda, *fint);
+            lib->fint = fint;
+        }
 
-            const double dt = opts.custom_sfh_step;
-            // Compute lookback time (t=0 is when the galaxy is observed, t>0 is in the past) in [yr]
-            vec1d ltime = dt*indgen<double>(uint_t(ceil(e10(output_age[ia])/dt)+1.0));
+        return std::shared_ptr<const library_t>(lib);
+    };
+
+    // Function to build all the models of a given SFH (i.e., all ages at once)
+    const bool closed_form = (opts.custom_sfh_kind != sfh_kind::expression);
+    auto do_models = [&](generator_workspace_t& ws, model_task_t& task) {
+        const library_t& lib = *task.lib;
+        const ssp_bc03& ssp = lib.ssp;
+        model_id_pair& tm = ws.m;
+        grid_ids(task.igrid, tm.idm);
+
+        float& model_mass  = tm.model.props[prop_id::mass];
+        float& model_mform = tm.model.props[prop_id::mform];
+        float& model_sfr   = tm.model.props[prop_id::sfr];
+        float& model_ssfr  = tm.model.props[prop_id::ssfr];
+
+        const uint_t nage = output_age.size();
+        vec2d& batch_formed = ws.batch_formed;
+        vec2f& batch_props = ws.batch_props;
+        vec1b& batch_keep = ws.batch_keep;
+        vec1b& batch_cached = ws.batch_cached;
+        batch_formed.resize(nage, ssp.age.size());
+        batch_props.resize(nage, nprop);
+        batch_keep.resize(nage);
+        batch_cached.resize(nage);
+        std::fill(batch_formed.data.begin(), batch_formed.data.end(), 0.0);
+        std::fill(batch_cached.data.begin(), batch_cached.data.end(), false);
+
+        // First compute the mass formed in each SSP age bin, for each age
+        for (uint_t ia : range(nage)) {
+            tm.idm[grid_id::age] = ia;
+            batch_keep.safe[ia] = true;
+
+            if (!model_mask.empty()) {
+                // Skip this SED if none of its models are needed
+                ws.tidm = tm.idm;
+                ws.tidm[grid_id::z] = ws.tidm[grid_id::av] = npos;
+                if (!mask_has_any(ws.tidm)) {
+                    skip_models(pg, output_av.size()*output_z.size());
+                    batch_keep.safe[ia] = false;
+                    continue;
+                }
+            }
 
-            // Build analytic SFH
-            vec1d sfh; {
-                auto lock = (opts.parallel == parallel_choice::generators ?
-                    std::unique_lock<std::mutex>(sfh_mutex) : std::unique_lock<std::mutex>());
+            if (lib.sed_cache && lib.sed_cache->valid(task.ic*nage + ia)) {
+                // Already in the SED cache, nothing to compute
+                batch_cached.safe[ia] = true;
+                continue;
+            }
 
-                evaluate_sfh_custom(tm.idm, ltime, sfh);
+            // Mass formed in each SSP age bin
+            vec1d& formed = ws.formed;
+            double tsfr = dnan;
+            if (closed_form) {
+                // Closed form, no need to sample the SFH
+                tsfr = sfh_closed_form(tm.idm, ssp, formed);
             }
 
-            // Integrate SFH on local time grid
-            vec1d tpl_flux(ssp.lambda.size());
-            double tmodel_mass  = 0.0;
-            double tformed_mass = 0.0;
-            ssp.integrate(ltime, sfh, [&](uint_t it, double formed) {
-                tmodel_mass  += formed*ssp.mass.safe[it];
-                tformed_mass += formed;
-                tpl_flux     += formed*ssp.sed.safe(it,_);
-            });
+            if (!closed_form || !input.sfh_quant.empty()) {
+                // Build analytic SFH
+                // NB: each thread has its own copy of the SFH expression, so no lock is needed
+                if (!ws.sfh_expr) {
+                    ws.sfh_expr.reset(new tinyexpr_wrapper());
+                    compile_sfh_custom(*ws.sfh_expr);
+                }
+
+                vec1d& ltime = ws.ltime;
+                vec1d& sfh = ws.sfh;
+                sample_sfh_custom(*ws.sfh_expr, tm.idm, ssp, ltime, sfh);
+
+                if (!closed_form) {
+                    // Integrate SFH on local time grid
+                    formed.resize(ssp.age.size());
+                    formed[_] = 0.0;
+                    ssp.integrate(ltime, sfh, [&](uint_t it, double f) {
+                        formed.safe[it] = f;
+                    });
+
+                    if (opts.sfr_avg > 0) {
+                        // Average SFR over the past X yr
+                        double t1 = min(opts.sfr_avg, ltime.back());
+                        tsfr = integrate(ltime, sfh, 0.0, t1)/opts.sfr_avg;
+                    } else {
+                        // Use instantaneous SFR
+                        tsfr = interpolate(sfh, ltime, 0.0);
+                    }
+                }
 
-            model_mass = tmodel_mass;
-            model_mform = tformed_mass*ssp.mass.safe[0];
+                // Compute SFH quantities
+                if (!input.sfh_quant.empty()) {
+                    compute_sfh_quantities_impl(ltime, sfh, tm.model);
+                }
+            }
 
-            // Compute SFH quantities
-            if (!input.sfh_quant.empty()) {
-                compute_sfh_quantities_impl(ltime, sfh, tm.model);
+            model_sfr = tsfr;
+
+            for (uint_t it : range(formed)) {
+                batch_formed.safe(ia,it) = formed.safe[it];
+            }
+            for (uint_t ip : range(nprop)) {
+                batch_props.safe(ia,ip) = tm.model.props.safe[ip];
             }
+        }
+
+        // Then sum SSPs for all ages at once: SEDs, stellar mass, formed mass and
+        // bolometric corrections
+        ssp_sum(batch_formed, ssp.sed, ws.batch_flux);
+        ssp_sum(batch_formed, lib.ssp_props, ws.batch_sums);
+
+        vec1d& tpl_flux = ws.tpl_flux;
+        vec1d& tpl_bol_corr = ws.tpl_bol_corr;
+        tpl_flux.resize(lib.lambda.size());
+        tpl_bol_corr.resize(full_sed ? lib.bol_weight.dims[0] : lib.bol_corr.dims[1]);
+
+        for (uint_t ia : range(nage)) {
+            if (!batch_keep.safe[ia]) continue;
+
+            tm.idm[grid_id::age] = ia;
+            for (uint_t ip : range(nprop)) {
+                tm.model.props.safe[ip] = batch_props.safe(ia,ip);
+            }
+
+            if (full_sed) {
+                vec1d& sed = ws.sed_full;
+                vec1f& values = ws.sed_values;
+                const uint_t ir = task.ic*nage + ia;
+
+                if (!batch_cached.safe[ia]) {
+                    sed.resize(ssp.lambda.size());
+                    for (uint_t il : range(sed)) {
+                        sed.safe[il] = ws.batch_flux.safe(ia,il);
+                    }
 
-            if (opts.sfr_avg > 0) {
-                // Average SFR over the past X yr
-                double t1 = min(opts.sfr_avg, ltime.back());
-                model_sfr = integrate(ltime, sfh, 0.0, t1)/opts.sfr_avg;
+                    values.resize(3+nsfhq);
+                    values.safe[0] = ws.batch_sums.safe(ia,0);
+                    values.safe[1] = ws.batch_sums.safe(ia,1)*ssp.mass.safe[0];
+                    values.safe[2] = model_sfr;
+                    for (uint_t i : range(nsfhq)) {
+                        values.safe[3+i] = tm.model.props.safe[output.ifirst_sfhq+i];
+                    }
+                }
+
+                if (lib.sed_cache) {
+                    if (!batch_cached.safe[ia]) {
+                        lib.sed_cache->write(ir, sed, values);
+                    }
+
+                    // NB: always use the SED as stored in the cache, so that models do not
+                    // depend on whether they were cached or not
+                    lib.sed_cache->read(ir, sed, values);
+                }
+
+                model_mass = values.safe[0];
+                model_mform = values.safe[1];
+                model_sfr = values.safe[2];
+                for (uint_t i : range(nsfhq)) {
+                    tm.model.props.safe[output.ifirst_sfhq+i] = values.safe[3+i];
+                }
+
+                // Select the wavelengths needed for this run, and correct the bolometric
+                // luminosities for the rest
+                for (uint_t il : range(tpl_flux)) {
+                    tpl_flux.safe[il] = sed.safe[lib.lkeep.safe[il]];
+                }
+                for (uint_t i : range(tpl_bol_corr)) {
+                    double c = 0.0;
+                    for (uint_t il : range(sed)) {
+                        c += lib.bol_weight.safe(i,il)*sed.safe[il];
+                    }
+
+                    tpl_bol_corr.safe[i] = c;
+                }
             } else {
-                // Use instantaneous SFR
-                model_sfr = interpolate(sfh, ltime, 0.0);
+                for (uint_t il : range(tpl_flux)) {
+                    tpl_flux.safe[il] = ws.batch_flux.safe(ia,il);
+                }
+                for (uint_t i : range(tpl_bol_corr)) {
+                    tpl_bol_corr.safe[i] = ws.batch_sums.safe(ia,2+i);
+                }
+
+                model_mass = ws.batch_sums.safe(ia,0);
+                model_mform = ws.batch_sums.safe(ia,1)*ssp.mass.safe[0];
             }
 
             model_ssfr = model_sfr/model_mass;
 
             // The rest is not specific to the SFH, use generic code
-            build_and_send_impl(fitter, pg, ssp.lambda, tpl_flux, dust_law, igm_abs,
-                output_age[ia], tm.idm, tm.model);
-        };
+            build_and_send_impl(fitter, pg, lib.lambda, lib.dust_law, *lib.fint, ws);
+        }
+    };
+
+    // In parallel mode, models from all libraries are sent to a single pool of workers,
+    // while the next library is read in the background
+    bool parallel = (opts.parallel == parallel_choice::generators);
+    thread::worker_pool<model_task_t,generator_workspace_t> pool;
+    if (parallel) {
+        pool.start(opts.n_thread, do_models, input.lambda.size(), nprop, nparam);
+        // NB: tasks hold a reference to their library, so limit the number of libraries queued
+        pool.set_max_queued(max_queued_libs*ncustom);
+    }
+
+    auto launch = (parallel ? std::launch::async : std::launch::deferred);
+    std::future<std::shared_ptr<const library_t>> next_lib;
+    if (!lib_im.empty()) {
+        next_lib = std::async(launch, load_library, 0, std::shared_ptr<const library_t>());
+    }
 
-        thread::worker_pool<model_id_pair> pool;
-        if (opts.parallel == parallel_choice::generators) {
-            pool.start(opts.n_thread, do_model);
+    generator_workspace_t ws(input.lambda.size(), nprop, nparam);
+    vec1u idm(nparam);
+    model_task_t task;
+
+    for (uint_t il : range(lib_im)) {
+        task.lib = next_lib.get();
+        if (!task.lib) {
+            return false;
+        }
+
+        // Prefetch next library
+        if (il+1 < lib_im.size()) {
+            next_lib = std::async(launch, load_library, il+1, task.lib);
         }
 
-        // Iterate over all models
+        idm[_] = 0;
+        idm[grid_id::metal] = task.lib->im;
+
+        // Iterate over all SFHs
         for (uint_t ic = 0; ic < ncustom; ++ic) {
-            for (uint_t ia : range(output_age)) {
-                m.idm[grid_id::age] = ia;
-
-                if (opts.parallel == parallel_choice::generators) {
-                    // Parallel
-                    while (opts.max_queued_fits > 0 &&
-                        pool.remaining() > opts.max_queued_fits) {
-                        thread::sleep_for(1e-6);
-                    }
+            idm[grid_id::age] = 0;
+            task.igrid = model_id(idm);
+            task.ic = ic;
 
-                    pool.process(m);
-                } else {
-                    // Single threaded
-                    do_model(m);
-                }
+            if (parallel) {
+                // Parallel
+                pool.process(task);
+            } else {
+                // Single threaded
+                do_models(ws, task);
             }
 
             // Go to next model
-            increment_index_list(m.idm, grid_dims);
+            increment_index_list(idm, grid_dims);
         }
+    }
 
-        if (opts.parallel == parallel_choice::generators) {
-            while (pool.remaining() != 0) {
-                thread::sleep_for(1e-6);
-            }
+    task.lib.reset();
 
-            pool.join();
-        }
+    if (parallel) {
+        pool.join();
     }
 
     return true;
@@ -227,9 +925,7 @@ bool gridder_t::build_and_send_custom(fitter_t& fitter) {
 
 bool gridder_t::build_template_custom(uint_t iflat, vec1f& lam, vec1f& flux) const {
     vec1u idm = grid_ids(iflat);
-    uint_t ia = idm[grid_id::age];
     uint_t im = idm[grid_id::metal];
-    const vec1f& output_age = output.grid[grid_id::age];
 
     ssp_bc03* ssp = cached_ssp_bc03.get();
 
@@ -258,24 +954,33 @@ bool gridder_t::build_template_custom(uint_t iflat, vec1f& lam, vec1f& flux) con
         }
     }
 
-    // Build analytic SFH
-    double dt = opts.custom_sfh_step;
-    vec1d ltime = dt*indgen<double>(uint_t(ceil(e10(output_age[ia])/dt)+1.0));
-    vec1d sfh; {
-        auto lock = (opts.n_thread > 1 ?
-            std::unique_lock<std::mutex>(sfh_mutex) : std::unique_lock<std::mutex>());
+    // Mass formed in each SSP age bin
+    vec1d formed;
+    if (opts.custom_sfh_kind != sfh_kind::expression) {
+        // Closed form SFH
+        sfh_closed_form(idm, *ssp, formed);
+    } else {
+        // Build analytic SFH
+        vec1d ltime, sfh; {
+            auto lock = (opts.n_thread > 1 ?
+                std::unique_lock<std::mutex>(sfh_mutex) : std::unique_lock<std::mutex>());
 
-        evaluate_sfh_custom(idm, ltime, sfh);
+            sample_sfh_custom(sfh_expr, idm, *ssp, ltime, sfh);
+        }
+
+        // Integrate SFH on local time grid
+        formed = replicate(0.0, ssp->age.size());
+        ssp->integrate(ltime, sfh, [&](uint_t it, double f) {
+            formed.safe[it] = f;
+        });
     }
 
-    // Integrate SFH on local time grid
-    vec1d tpl_flux(ssp->lambda.size());
-    ssp->integrate(ltime, sfh, [&](uint_t it, double formed) {
-        tpl_flux += formed*ssp->sed.safe(it,_);
-    });
+    // Sum SSPs
+    vec2d tpl_flux;
+    ssp_sum(reform(formed, 1, formed.size()), ssp->sed, tpl_flux);
 
     lam = ssp->lambda;
-    flux = tpl_flux;
+    flux = tpl_flux(0,_);
 
     return true;
 }
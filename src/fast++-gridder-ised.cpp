@@ -272,29 +272,60 @@ bool gridder_t::get_age_bounds(const vec1f& ised_age, float nage,
 }
 
 bool gridder_t::build_and_send_ised(fitter_t& fitter) {
-    model_id_pair m;
-    m.model.flux.resize(input.lambda.size());
-    m.model.props.resize(nprop);
-    m.idm.resize(nparam);
-
-    galaxev_ised ised;
-
     const vec1f& output_metal = output.grid[grid_id::metal];
     const vec1f& output_tau = output.grid[grid_id::custom+0];
     const vec1f& output_age = output.grid[grid_id::age];
     const vec1f& output_z = output.grid[grid_id::z];
     const vec1f& output_av = output.grid[grid_id::av];
 
+    // Library file, and pre-computed quantities shared by all the models built from it
+    struct library_t {
+        uint_t im = 0, it = 0;
+        galaxev_ised ised;
+        vec1d lambda;
+        vec2d bol_corr;
+        vec2d dust_law;
+        std::shared_ptr<const filter_integrator_t> fint;
+    };
+
+    // Model to build: the library it comes from, and its grid ID (with z = av = 0)
+    struct model_task_t {
+        std::shared_ptr<const library_t> lib;
+        uint_t igrid = npos;
+    };
+
     auto pg = progress_start(nmodel);
+
+    // List the libraries to read
+    vec1u lib_im, lib_it;
     for (uint_t im : range(output_metal))
     for (uint_t it : range(output_tau)) {
-        m.idm[grid_id::metal] = im;
-        m.idm[grid_id::custom] = it;
+        if (!model_mask.empty()) {
+            // Skip this library if none of its models are needed
+            vec1u tidm = replicate(npos, grid_dims.size());
+            tidm[grid_id::metal] = im;
+            tidm[grid_id::custom] = it;
+            if (!mask_has_any(tidm)) {
+                skip_models(pg, output_age.size()*output_av.size()*output_z.size());
+                continue;
+            }
+        }
+
+        lib_im.push_back(im);
+        lib_it.push_back(it);
+    }
+
+    // Function to read a library and prepare it for building models
+    auto load_library = [&](uint_t il, std::shared_ptr<const library_t> prev) {
+        std::shared_ptr<library_t> lib(new library_t());
+        lib->im = lib_im[il];
+        lib->it = lib_it[il];
+        galaxev_ised& ised = lib->ised;
 
         // Load CSP
-        std::string filename = get_library_file_ised(im, it);
+        std::string filename = get_library_file_ised(lib->im, lib->it);
         if (!ised.read(filename)) {
-            return false;
+            return std::shared_ptr<const library_t>();
         }
 
         // Make sure the requested age is covered by the library
@@ -302,7 +333,7 @@ bool gridder_t::build_and_send_ised(fitter_t& fitter) {
         double x;
         if (!get_age_bounds(ised.age, e10(min(output_age)), p, x) ||
             !get_age_bounds(ised.age, e10(max(output_age)), p, x)) {
-            return false;
+            return std::shared_ptr<const library_t>();
         }
 
         // Apply velocity dispersion
@@ -310,96 +341,160 @@ bool gridder_t::build_and_send_ised(fitter_t& fitter) {
             ised.fluxes = convolve_vdisp(ised.lambda, ised.fluxes, opts.apply_vdisp);
         }
 
-        // Pre-compute dust law & IGM absorption (they don't change with SFH)
-        vec2d dust_law = build_dust_law(output_av, ised.lambda);
-        vec2d igm_abs;
-        if (!opts.no_igm) {
-            igm_abs = build_igm_absorption(output_z, ised.lambda);
+        // Only keep the wavelengths that are needed, and correct bolometric luminosities
+        // for the rest
+        vec1u lkeep = build_wavelength_selection(ised.lambda);
+        lib->bol_corr = build_bolometric_correction(ised.lambda, ised.fluxes, lkeep,
+            build_dust_law(output_av, ised.lambda));
+        ised.lambda = vec1f(ised.lambda[lkeep]);
+        ised.fluxes = vec2f(ised.fluxes(_,lkeep));
+        lib->lambda = ised.lambda;
+
+        // Pre-compute dust law & filter integration (they don't change with SFH)
+        lib->dust_law = build_dust_law(output_av, ised.lambda);
+
+        // NB: filter integration is only re-computed when the wavelength grid changes
+        if (prev && prev->fint->lambda.size() == lib->lambda.size() &&
+            count(prev->fint->lambda != lib->lambda) == 0) {
+            lib->fint = prev->fint;
+        } else {
+            std::shared_ptr<filter_integrator_t> fint(new filter_integrator_t());
+            update_filter_integrator(lib->lambda, *fint);
+            lib->fint = fint;
         }
 
-        // Function to build a model
-        auto do_model = [&](model_id_pair& tm) {
-            float& model_mass = tm.model.props[prop_id::mass];
-            float& model_mform = tm.model.props[prop_id::mform];
-            float& model_sfr = tm.model.props[prop_id::sfr];
-            float& model_ssfr = tm.model.props[prop_id::ssfr];
-            float& model_a2t = tm.model.props[prop_id::custom+0];
-            uint_t ia = tm.idm[grid_id::age];
-
-            // Interpolate the galaxev grid at the requested age
-            vec1f tpl_flux;
-            double nage = e10(output_age[ia]);
-
-            std::array<uint_t,2> p;
-            double x;
-            get_age_bounds(ised.age, nage, p, x);
-
-            tpl_flux = (1.0 - x)*ised.fluxes.safe(p[0],_) + x*ised.fluxes.safe(p[1],_);
-            model_mass = (1.0 - x)*ised.mass.safe[p[0]] + x*ised.mass.safe[p[1]];
-            model_mform = (1.0 - x)*ised.mform.safe[p[0]] + x*ised.mform.safe[p[1]];
-
-            // Compute SFH quantities
-            if (!input.sfh_quant.empty()) {
-                // Get tabulated SFH from .ised file
-                vec1d ltime = nage - ised.age[_-p[0]];
-                ltime.push_back(0.0);
-                ltime = reverse(ltime);
-
-                vec1d sfh = ised.sfr[_-p[0]];
-                sfh.push_back((1.0 - x)*ised.sfr.safe[p[0]] + x*ised.sfr.safe[p[1]]);
-                sfh = reverse(sfh);
-
-                compute_sfh_quantities_impl(ltime, sfh, tm.model);
+        return std::shared_ptr<const library_t>(lib);
+    };
+
+    // Function to build a model
+    auto do_model = [&](generator_workspace_t& ws, model_task_t& task) {
+        const library_t& lib = *task.lib;
+        const galaxev_ised& ised = lib.ised;
+        model_id_pair& tm = ws.m;
+        grid_ids(task.igrid, tm.idm);
+
+        float& model_mass = tm.model.props[prop_id::mass];
+        float& model_mform = tm.model.props[prop_id::mform];
+        float& model_sfr = tm.model.props[prop_id::sfr];
+        float& model_ssfr = tm.model.props[prop_id::ssfr];
+        float& model_a2t = tm.model.props[prop_id::custom+0];
+        uint_t ia = tm.idm[grid_id::age];
+
+        if (!model_mask.empty()) {
+            // Skip this SED if none of its models are needed
+            ws.tidm = tm.idm;
+            ws.tidm[grid_id::z] = ws.tidm[grid_id::av] = npos;
+            if (!mask_has_any(ws.tidm)) {
+                skip_models(pg, output_av.size()*output_z.size());
+                return;
             }
+        }
 
-            if (opts.sfr_avg > 0) {
-                // Average SFR over the past X yr
-                double t1 = nage;
-                double t0 = max(t1 - opts.sfr_avg, ised.age[0]);
-                model_sfr = integrate(ised.age, ised.sfr, t0, t1)/opts.sfr_avg;
-            } else {
-                // Use instantaneous SFR
-                model_sfr = (1.0 - x)*ised.sfr.safe[p[0]] + x*ised.sfr.safe[p[1]];
-            }
+        // Interpolate the galaxev grid at the requested age
+        double nage = e10(output_age[ia]);
 
-            model_ssfr = model_sfr/model_mass;
-            model_a2t = output_age[ia] - output_tau[it];
+        std::array<uint_t,2> p;
+        double x;
+        get_age_bounds(ised.age, nage, p, x);
 
-            // The rest is not specific to the SFH, use generic code
-            build_and_send_impl(fitter, pg, ised.lambda, tpl_flux, dust_law, igm_abs,
-                output_age[ia], tm.idm, tm.model);
-        };
+        ws.tpl_flux.resize(ised.lambda.size());
+        for (uint_t il : range(ws.tpl_flux)) {
+            ws.tpl_flux.safe[il] = (1.0 - x)*ised.fluxes.safe(p[0],il) + x*ised.fluxes.safe(p[1],il);
+        }
 
-        thread::worker_pool<model_id_pair> pool;
-        if (opts.parallel == parallel_choice::generators) {
-            pool.start(opts.n_thread, do_model);
+        ws.tpl_bol_corr.resize(lib.bol_corr.dims[1]);
+        for (uint_t i : range(ws.tpl_bol_corr)) {
+            ws.tpl_bol_corr.safe[i] = (1.0 - x)*lib.bol_corr.safe(p[0],i) + x*lib.bol_corr.safe(p[1],i);
         }
 
+        model_mass = (1.0 - x)*ised.mass.safe[p[0]] + x*ised.mass.safe[p[1]];
+        model_mform = (1.0 - x)*ised.mform.safe[p[0]] + x*ised.mform.safe[p[1]];
+
+        // Compute SFH quantities
+        if (!input.sfh_quant.empty()) {
+            // Get tabulated SFH from .ised file
+            vec1d ltime = nage - ised.age[_-p[0]];
+            ltime.push_back(0.0);
+            ltime = reverse(ltime);
+
+            vec1d sfh = ised.sfr[_-p[0]];
+            sfh.push_back((1.0 - x)*ised.sfr.safe[p[0]] + x*ised.sfr.safe[p[1]]);
+            sfh = reverse(sfh);
+
+            compute_sfh_quantities_impl(ltime, sfh, tm.model);
+        }
+
+        if (opts.sfr_avg > 0) {
+            // Average SFR over the past X yr
+            double t1 = nage;
+            double t0 = max(t1 - opts.sfr_avg, ised.age[0]);
+            model_sfr = integrate(ised.age, ised.sfr, t0, t1)/opts.sfr_avg;
+        } else {
+            // Use instantaneous SFR
+            model_sfr = (1.0 - x)*ised.sfr.safe[p[0]] + x*ised.sfr.safe[p[1]];
+        }
+
+        model_ssfr = model_sfr/model_mass;
+        model_a2t = output_age[ia] - output_tau[lib.it];
+
+        // The rest is not specific to the SFH, use generic code
+        build_and_send_impl(fitter, pg, lib.lambda, lib.dust_law, *lib.fint, ws);
+    };
+
+    // In parallel mode, models from all libraries are sent to a single pool of workers,
+    // while the next library is read in the background
+    bool parallel = (opts.parallel == parallel_choice::generators);
+    thread::worker_pool<model_task_t,generator_workspace_t> pool;
+    if (parallel) {
+        pool.start(opts.n_thread, do_model, input.lambda.size(), nprop, nparam);
+        // NB: tasks hold a reference to their library, so limit the number of libraries queued
+        pool.set_max_queued(max_queued_libs*output_age.size());
+    }
+
+    auto launch = (parallel ? std::launch::async : std::launch::deferred);
+    std::future<std::shared_ptr<const library_t>> next_lib;
+    if (!lib_im.empty()) {
+        next_lib = std::async(launch, load_library, 0, std::shared_ptr<const library_t>());
+    }
+
+    generator_workspace_t ws(input.lambda.size(), nprop, nparam);
+    vec1u idm(nparam);
+    model_task_t task;
+
+    for (uint_t il : range(lib_im)) {
+        task.lib = next_lib.get();
+        if (!task.lib) {
+            return false;
+        }
+
+        // Prefetch next library
+        if (il+1 < lib_im.size()) {
+            next_lib = std::async(launch, load_library, il+1, task.lib);
+        }
+
+        idm[_] = 0;
+        idm[grid_id::metal] = task.lib->im;
+        idm[grid_id::custom] = task.lib->it;
+
         // Iterate over all models
         for (uint_t ia : range(output_age)) {
-            m.idm[grid_id::age] = ia;
+            idm[grid_id::age] = ia;
+            task.igrid = model_id(idm);
 
-            if (opts.parallel == parallel_choice::generators) {
+            if (parallel) {
                 // Parallel
-                while (opts.max_queued_fits > 0 &&
-                    pool.remaining() > opts.max_queued_fits) {
-                    thread::sleep_for(1e-6);
-                }
-
-                pool.process(m);
+                pool.process(task);
             } else {
                 // Single threaded
-                do_model(m);
+                do_model(ws, task);
             }
         }
+    }
 
-        if (opts.parallel == parallel_choice::generators) {
-            while (pool.remaining() != 0) {
-                thread::sleep_for(1e-6);
-            }
+    task.lib.reset();
 
-            pool.join();
-        }
+    if (parallel) {
+        pool.join();
     }
 
     return true;
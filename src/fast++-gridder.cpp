@@ -1,38 +1,5 @@
 #include "fast++.hpp"
 
-void gridder_t::cache_manager_t::write_model(const model_t& model) {
-    if (!cache_file.is_open()) return;
-
-    // TODO: Consider doing this in a worker thread if it slows down execution
-    file::write_as<std::uint32_t>(cache_file, model.igrid);
-    file::write(cache_file, model.props);
-    file::write(cache_file, model.flux);
-
-    if (!cache_file) {
-        print("");
-        warning("could not write to cache file anymore");
-        warning("in case you ran out of disk space, the cache file has been removed");
-        print("");
-        cache_file.close();
-        file::remove(cache_filename);
-    }
-}
-
-bool gridder_t::cache_manager_t::read_model(model_t& model) {
-    if (!cache_file.is_open()) return false;
-
-    file::read_as<std::uint32_t>(cache_file, model.igrid);
-    file::read(cache_file, model.props);
-    file::read(cache_file, model.flux);
-
-    if (!cache_file) {
-        cache_file.close();
-        return false;
-    }
-
-    return true;
-}
-
 gridder_t::gridder_t(const options_t& opt, const input_state_t& inp, output_state_t& out) :
     opts(opt), input(inp), output(out) {
 
@@ -257,15 +224,76 @@ gridder_t::gridder_t(const options_t& opt, const input_state_t& inp, output_stat
         out.mc_best_model = replicate(npos, input.id.size(), opts.n_sim);
         out.mc_best_props = replicate(fnan, input.id.size(), nprop, opts.n_sim);
     }
+}
+
+bool gridder_t::check_options() {
+    // Check that the requested column names make sense
+    bool bad = false;
+    vec1s base_names = {"id", "chi2", "nmodel"};
+    for (auto c : opts.output_columns) {
+        c = to_lower(c);
+        if (!is_any_of(c, to_lower(output.param_names)) && !is_any_of(c, to_lower(output.param_names))
+            && !is_any_of(c, base_names)) {
+            error("unknown column '", c, "'");
+            bad = true;
+        }
+    }
+
+    if (bad) {
+        error("some of the requested columns do not exist, cannot proceed");
+        return false;
+    }
+
+    // If we use a custom SFH, compile it and check that the expression is valid
+    if (opts.sfh == sfh_type::custom) {
+        if (!compile_sfh_custom(sfh_expr)) {
+            return false;
+        }
+
+        // If it has a closed form, check that it matches the expression
+        if (opts.custom_sfh_kind != sfh_kind::expression) {
+            custom_tau_param = where_first(to_lower(opts.custom_params) == "log_tau");
+            if (!check_sfh_closed_form()) {
+                return false;
+            }
+        }
+    } else if (opts.sed_cache) {
+        warning("SED_CACHE only applies to custom SFHs (SFH='custom'), it will be ignored");
+    }
+
+    // If we use an exclude pattern, compile it and check that the expression is valid
+    if (!opts.grid_exclude.empty()) {
+        vec1s p(nparam);
+        for (uint_t ip : range(nparam)) {
+            p[ip] = output.param_names[ip];
+        }
+
+        if (!exclude_expr.compile(opts.grid_exclude, p)) {
+            return false;
+        }
+    }
+
+    // Find out which models can be fit
+    build_valid_mask();
 
+    // Check if the models are in the cache
+    init_cache();
+
+    return true;
+}
+
+void gridder_t::init_cache() {
     if (!opts.no_cache) {
         // Base library properties
         cache.cache_filename = opts.output_dir+opts.library+"_"+opts.resolution+"_"+
             opts.name_imf+"_"+opts.name_sfh+"_"+opts.dust_law+"_";
 
+        // NB: the flux channels are not part of this hash, see below
+        // NB: only the models that can be fit are stored, see build_valid_mask()
         std::string grid_hash = hash(output.grid[_-(grid_id::custom-1)], output.param_names,
-            input.lambda, opts.dust_noll_eb, opts.dust_noll_delta, opts.sfr_avg, opts.lambda_ion,
-            opts.cosmo.H0, opts.cosmo.wm, opts.cosmo.wL, opts.apply_vdisp, opts.no_igm);
+            opts.dust_noll_eb, opts.dust_noll_delta, opts.sfr_avg, opts.lambda_ion,
+            opts.cosmo.H0, opts.cosmo.wm, opts.cosmo.wL, opts.apply_vdisp, opts.no_igm,
+            opts.no_max_age, opts.grid_exclude);
 
         // Additional grid parameter
         switch (opts.sfh) {
@@ -275,8 +303,12 @@ gridder_t::gridder_t(const options_t& opt, const input_state_t& inp, output_stat
         case sfh_type::single:
             break;
         case sfh_type::custom:
+            // NB: closed-form integration and the time grid (uniform or adaptive) give
+            // slightly different fluxes
             grid_hash = hash(grid_hash, opts.custom_sfh,
-                output.grid[grid_id::custom+indgen(nparam-grid_id::custom)]);
+                output.grid[grid_id::custom+indgen(nparam-grid_id::custom)],
+                uint_t(opts.custom_sfh_kind), opts.custom_sfh_step, opts.custom_sfh_adaptive,
+                opts.custom_sfh_tol, opts.custom_sfh_lookback);
             break;
         }
 
@@ -290,91 +322,156 @@ gridder_t::gridder_t(const options_t& opt, const input_state_t& inp, output_stat
             grid_hash = hash(grid_hash, r.name, r.cont1_low, r.cont1_up, r.cont2_low, r.cont2_up);
         }
 
-        cache.cache_filename += grid_hash+".grid";
+        if (opts.cache_columns) {
+            // One file per flux channel, which can be shared by catalogs with other filters
+            // NB: missing columns are built in build_and_send_all()
+            std::string prefix = cache.cache_filename+grid_hash+"_";
+            columns.init(prefix, grid_hash, nvalid, nprop, input.filters);
 
-        if (opts.verbose) {
-            note("cache file is '", cache.cache_filename, "'");
-        }
+            if (opts.verbose) {
+                note("cache files are '", prefix, "*.col'");
+                note("checking cache integrity...");
+            }
 
-        // Open grid file
-        if (file::exists(cache.cache_filename)) {
-            if (opts.verbose) note("checking cache integrity...");
-            cache.cache_file.open(cache.cache_filename, std::ios::binary | std::ios::in);
+            columns.check(opts.verbose);
+            read_from_cache = columns.complete();
+        } else {
+            grid_hash = hash(grid_hash, input.lambda);
+            cache.init(cache.cache_filename+grid_hash+".grid", grid_hash, nvalid,
+                input.lambda.size(), nprop);
 
-            cache.cache_file.seekg(0, std::ios_base::end);
-            uint_t size = cache.cache_file.tellg();
-            uint_t size_expected = nmodel*(
-                sizeof(std::uint32_t)+sizeof(float)*(nprop+input.lambda.size())
-            );
+            if (opts.verbose) {
+                note("cache file is '", cache.cache_filename, "'");
+            }
 
-            if (size != size_expected) {
-                warning("cache file is corrupted or invalid, will overwrite it");
-                warning("found ", size, " bytes, expected ", size_expected, " (one model is ",
-                    size_expected/nmodel, " bytes)");
-                cache.cache_file.close();
-                read_from_cache = false;
+            // Check grid file
+            // NB: an incomplete cache is not read here, but resumed in build_and_send_all()
+            if (file::exists(cache.cache_filename)) {
+                if (opts.verbose) note("checking cache integrity...");
+                cache.check(opts.verbose);
+                read_from_cache = cache.complete;
             } else {
-                if (opts.verbose) note("cache file exists and seems valid, will use it");
-                cache.cache_file.seekg(0, std::ios_base::beg);
+                read_from_cache = false;
             }
-        } else {
-            read_from_cache = false;
         }
 
-        if (!read_from_cache) {
-            cache.cache_file.open(cache.cache_filename, std::ios::binary | std::ios::out);
-
-            if (!cache.cache_file.is_open()) {
-                warning("cache file could not be created");
-                warning("the program will not use the cache");
+        if (!read_from_cache && opts.coarse_grid_step > 1) {
+            if (opts.verbose) {
+                note("the cache will not be created since only part of the grid will be built "
+                    "(COARSE_GRID_STEP)");
             }
+        } else if (!read_from_cache) {
+            write_cache = true;
         }
     } else {
         read_from_cache = false;
     }
 }
 
-bool gridder_t::check_options() const {
-    // Check that the requested column names make sense
-    bool bad = false;
-    vec1s base_names = {"id", "chi2", "nmodel"};
-    for (auto c : opts.output_columns) {
-        c = to_lower(c);
-        if (!is_any_of(c, to_lower(output.param_names)) && !is_any_of(c, to_lower(output.param_names))
-            && !is_any_of(c, base_names)) {
-            error("unknown column '", c, "'");
-            bad = true;
-        }
+bit_mask_t::bit_mask_t(uint_t n, bool value) : nbit(n) {
+    words.resize((n + 63)/64);
+    fill(value);
+}
+
+void bit_mask_t::fill(bool value) {
+    words[_] = (value ? ~std::uint64_t(0) : std::uint64_t(0));
+    if (value && nbit % 64 != 0) {
+        // NB: keep the bits past the end unset, so they are not counted
+        words.back() = (std::uint64_t(1) << (nbit % 64)) - 1;
     }
+}
 
-    if (bad) {
-        error("some of the requested columns do not exist, cannot proceed");
-        return false;
+void bit_mask_t::invert() {
+    for (auto& w : words) {
+        w = ~w;
     }
 
-    // If we use a custom SFH, compile it and check that the expression is valid
-    if (opts.sfh == sfh_type::custom) {
-        vec1s p = {"t", "lage"};
-        append(p, opts.custom_params);
+    if (nbit % 64 != 0) {
+        words.back() &= (std::uint64_t(1) << (nbit % 64)) - 1;
+    }
+}
 
-        if (!sfh_expr.compile(opts.custom_sfh, p)) {
-            return false;
+void bit_mask_t::clear() {
+    words.clear();
+    block_rank.clear();
+    nbit = 0;
+}
+
+uint_t bit_mask_t::count() const {
+    uint_t n = 0;
+    for (auto w : words) {
+        n += bit_count(w);
+    }
+
+    return n;
+}
+
+void bit_mask_t::build_rank() {
+    block_rank.resize(words.size()/8 + 1);
+    uint_t r = 0;
+    for (uint_t iw : range(words)) {
+        if (iw % 8 == 0) {
+            block_rank.safe[iw/8] = r;
         }
+
+        r += bit_count(words.safe[iw]);
     }
 
-    // If we use an exclude pattern, compile it and check that the expression is valid
-    if (!opts.grid_exclude.empty()) {
-        vec1s p(nparam);
-        for (uint_t ip : range(nparam)) {
-            p[ip] = output.param_names[ip];
+    if (words.size() % 8 == 0) {
+        block_rank.back() = r;
+    }
+}
+
+bit_mask_t& bit_mask_t::operator&=(const bit_mask_t& m) {
+    for (uint_t iw : range(words)) {
+        words.safe[iw] &= m.words.safe[iw];
+    }
+
+    return *this;
+}
+
+void gridder_t::build_valid_mask() {
+    const vec1f& output_age = output.grid[grid_id::age];
+
+    model_valid = bit_mask_t(nmodel, true);
+
+    uint_t nold = 0, nexcl = 0;
+    vec1u idm(nparam);
+    for (uint_t igrid = 0; igrid < nmodel; ++igrid) {
+        if (!opts.no_max_age && output_age.safe[idm.safe[grid_id::age]] > auniv.safe[idm.safe[grid_id::z]]) {
+            // Age greater than the age of the universe
+            model_valid.set(igrid, false);
+            ++nold;
+        } else if (!opts.grid_exclude.empty()) {
+            // Custom exclude function
+            for (uint_t i : range(nparam)) {
+                exclude_expr.vars.safe[i] = output.grid.safe[i].safe[idm.safe[i]];
+            }
+
+            if (abs(exclude_expr.eval()) > 0) {
+                model_valid.set(igrid, false);
+                ++nexcl;
+            }
         }
 
-        if (!exclude_expr.compile(opts.grid_exclude, p)) {
-            return false;
+        increment_index_list(idm, grid_dims);
+    }
+
+    nvalid = nmodel - nold - nexcl;
+    model_valid.build_rank();
+
+    if (opts.verbose) {
+        if (nvalid == nmodel) {
+            note("all ", nmodel, " models can be fit");
+        } else {
+            note(nvalid, " models can be fit (", nold, " are older than the Universe, ",
+                nexcl, " are excluded by GRID_EXCLUDE)");
         }
     }
 
-    return true;
+    if (nvalid == 0) {
+        warning("no model can be fit, please check GRID_EXCLUDE and the age grid");
+    }
 }
 
 namespace dust {
@@ -499,17 +596,320 @@ vec2d gridder_t::build_dust_law(const vec1f& av, const vec1f& lambda) const {
     return dust_law;
 }
 
-vec2d gridder_t::build_igm_absorption(const vec1f& z, const vec1f& lambda) const {
-    vec2d igm_abs(z.size(), lambda.size());
-    for (uint_t iz : range(z)) {
-        igm_abs(iz,_) = igm::madau1995(z.safe[iz], lambda);
+double gridder_t::filter_weights_t::integrate(uint_t i, const vec1f& sed) const {
+    uint_t i0 = first.safe[i];
+    uint_t k0 = offset.safe[i];
+    uint_t nk = offset.safe[i+1] - k0;
+
+    double flux = 0.0;
+    for (uint_t k = 0; k < nk; ++k) {
+        flux += weight.safe[k0+k]*sed.safe[i0+k];
+    }
+
+    return flux;
+}
+
+gridder_t::filter_weights_t gridder_t::build_filter_weights(const vec<1,fast_filter_t>& filters,
+    const vec1d& lambda, double z, const vec1d& scale) const {
+
+    // This reproduces astro::sed2flux(): the SED is linearly interpolated on the wavelength
+    // grid of the filter, then multiplied by the filter response and integrated with the
+    // trapezoid rule. All these steps are linear in the SED, so they can be written as a
+    // weighted sum over the SED elements bracketing the filter.
+    filter_weights_t fw;
+    fw.first.resize(filters.size());
+    fw.offset.resize(filters.size()+1);
+    fw.offset.safe[0] = 0;
+
+    vec1d lam_z = lambda*(1.0 + z);
+    uint_t nlam = lam_z.size();
+
+    for (uint_t il : range(filters)) {
+        const vec1f& wl = filters.safe[il].wl;
+        const vec1f& tr = filters.safe[il].tr;
+        uint_t nw = wl.size();
+
+        fw.first.safe[il] = 0;
+        fw.offset.safe[il+1] = fw.offset.safe[il];
+
+        if (nw < 2 || nlam < 2 || wl.front() < lam_z.front() || wl.back() > lam_z.back()) {
+            // Filter goes out of model coverage, assume zero
+            continue;
+        }
+
+        // Find range of SED elements used by this filter
+        uint_t i0 = std::upper_bound(lam_z.data.begin(), lam_z.data.end(), wl.front()) -
+            lam_z.data.begin();
+        uint_t i1 = std::upper_bound(lam_z.data.begin(), lam_z.data.end(), wl.back()) -
+            lam_z.data.begin();
+        i0 = std::min(i0 == 0 ? 0 : i0-1, nlam-2);
+        i1 = std::min(i1, nlam-1);
+
+        uint_t k0 = fw.weight.size();
+        fw.first.safe[il] = i0;
+        fw.weight.resize(k0 + i1 - i0 + 1);
+        for (uint_t k = k0; k < fw.weight.size(); ++k) {
+            fw.weight.safe[k] = 0.0;
+        }
+
+        uint_t j = i0;
+        for (uint_t iw : range(nw)) {
+            // Trapezoid weight of this filter element
+            double dw = 0.5*((iw == nw-1 ? wl.safe[iw] : wl.safe[iw+1]) -
+                             (iw == 0    ? wl.safe[iw] : wl.safe[iw-1]));
+            double c = dw*tr.safe[iw];
+
+            // Linear interpolation of the SED
+            while (j < nlam-2 && lam_z.safe[j+1] <= wl.safe[iw]) ++j;
+            double x = (wl.safe[iw] - lam_z.safe[j])/(lam_z.safe[j+1] - lam_z.safe[j]);
+
+            fw.weight.safe[k0+j-i0]   += c*(1.0 - x);
+            fw.weight.safe[k0+j+1-i0] += c*x;
+        }
+
+        if (!scale.empty()) {
+            for (uint_t k = i0; k <= i1; ++k) {
+                fw.weight.safe[k0+k-i0] *= scale.safe[k];
+            }
+        }
+
+        fw.offset.safe[il+1] = fw.weight.size();
+    }
+
+    return fw;
+}
+
+gridder_t::lambda_window_t locate_window(const vec1d& lam, double l0, double l1) {
+    auto locate = [&](double l) {
+        gridder_t::lambda_bound_t b;
+        uint_t nlam = lam.size();
+        if (nlam < 2 || l <= lam.front()) {
+            return b;
+        }
+
+        if (l >= lam.back()) {
+            b.i = nlam-2;
+            b.x = 1.0;
+        } else {
+            b.i = std::upper_bound(lam.data.begin(), lam.data.end(), l) - lam.data.begin() - 1;
+            b.x = (l - lam.safe[b.i])/(lam.safe[b.i+1] - lam.safe[b.i]);
+        }
+
+        b.dl = b.x*(lam.safe[b.i+1] - lam.safe[b.i]);
+        return b;
+    };
+
+    gridder_t::lambda_window_t w;
+    w.lo = locate(l0);
+    w.hi = locate(l1);
+    return w;
+}
+
+template<typename T>
+void cumulative_integral(const vec1d& lam, const vec<1,T>& flux, vec1d& cum) {
+    cum.resize(lam.size());
+    if (cum.empty()) return;
+
+    cum.safe[0] = 0.0;
+    for (uint_t i = 1; i < lam.size(); ++i) {
+        cum.safe[i] = cum.safe[i-1] +
+            0.5*(lam.safe[i] - lam.safe[i-1])*(flux.safe[i] + flux.safe[i-1]);
+    }
+}
+
+template<typename T>
+double window_integral(const gridder_t::lambda_window_t& w, const vec1d& cum,
+    const vec<1,T>& flux) {
+
+    // Trapezoid integral from lam[0] to the bound, with linear interpolation of the flux
+    auto integral_to = [&](const gridder_t::lambda_bound_t& b) {
+        if (cum.size() < 2) return 0.0;
+        double f0 = flux.safe[b.i];
+        double f1 = f0 + b.x*(flux.safe[b.i+1] - f0);
+        return cum.safe[b.i] + 0.5*b.dl*(f0 + f1);
+    };
+
+    return integral_to(w.hi) - integral_to(w.lo);
+}
+
+void gridder_t::update_filter_integrator(const vec1d& lambda, filter_integrator_t& fint) const {
+    if (fint.lambda.size() == lambda.size() && count(fint.lambda != lambda) == 0) {
+        // Same wavelength grid, nothing to do
+        return;
+    }
+
+    const vec1f& output_z = output.grid[grid_id::z];
+
+    fint.lambda = lambda;
+    fint.obs.resize(output_z.size());
+    for (uint_t iz : range(output_z)) {
+        vec1d scale;
+        if (opts.no_igm) {
+            scale = replicate(lum2fl.safe[iz], lambda.size());
+        } else {
+            scale = lum2fl.safe[iz]*igm::madau1995(output_z.safe[iz], lambda);
+        }
+
+        fint.obs.safe[iz] = build_filter_weights(input.filters, lambda, output_z.safe[iz], scale);
+    }
+
+    fint.rest = build_filter_weights(input.rf_filters, lambda, 0.0, vec1d());
+    for (uint_t i : range(input.rf_filters)) {
+        double scale = rflum2fl*sqr(input.rf_lambda.safe[i]);
+        for (uint_t k = fint.rest.offset.safe[i]; k < fint.rest.offset.safe[i+1]; ++k) {
+            fint.rest.weight.safe[k] *= scale;
+        }
+    }
+
+    // Integration windows
+    fint.lion = locate_window(lambda, lambda.front(), opts.lambda_ion);
+
+    fint.abs_line.resize(input.abs_lines.size());
+    fint.abs_cont.resize(input.abs_lines.size(), 2);
+    for (uint_t i : range(input.abs_lines)) {
+        auto& l = input.abs_lines[i];
+        fint.abs_line.safe[i] = locate_window(lambda, l.line_low, l.line_up);
+        for (uint_t j : range(l.cont_low)) {
+            fint.abs_cont.safe(i,j) = locate_window(lambda, l.cont_low[j], l.cont_up[j]);
+        }
+    }
+
+    fint.cont_ratio.resize(input.cont_ratios.size(), 2);
+    for (uint_t i : range(input.cont_ratios)) {
+        auto& r = input.cont_ratios[i];
+        fint.cont_ratio.safe(i,0) = locate_window(lambda, r.cont1_low, r.cont1_up);
+        fint.cont_ratio.safe(i,1) = locate_window(lambda, r.cont2_low, r.cont2_up);
     }
-    return igm_abs;
+}
+
+vec1u gridder_t::build_wavelength_selection(const vec1d& lam) const {
+    // Find the wavelength elements of a library that are actually needed to compute the
+    // model fluxes and properties. The bolometric luminosities need the whole SED, but they
+    // are corrected for the dropped elements, see build_bolometric_correction().
+    uint_t nlam = lam.size();
+    vec1b keep(nlam);
+
+    auto keep_range = [&](double l0, double l1) {
+        // Keep the elements within [l0,l1], plus two on each side for interpolation
+        uint_t i0 = std::upper_bound(lam.data.begin(), lam.data.end(), l0) - lam.data.begin();
+        uint_t i1 = std::upper_bound(lam.data.begin(), lam.data.end(), l1) - lam.data.begin();
+        i0 = (i0 < 2 ? 0 : i0-2);
+        i1 = std::min(i1+1, nlam-1);
+        for (uint_t i = i0; i <= i1; ++i) {
+            keep.safe[i] = true;
+        }
+    };
+
+    // Observed filters at all redshifts
+    const vec1f& output_z = output.grid[grid_id::z];
+    for (uint_t iz : range(output_z)) {
+        for (auto& f : input.filters) {
+            keep_range(f.wl.front()/(1.0 + output_z.safe[iz]), f.wl.back()/(1.0 + output_z.safe[iz]));
+        }
+    }
+
+    // Rest-frame filters
+    for (auto& f : input.rf_filters) {
+        keep_range(f.wl.front(), f.wl.back());
+    }
+
+    // Ionizing luminosity
+    keep_range(lam.front(), opts.lambda_ion);
+
+    // Absorption lines and continuum indices
+    for (auto& l : input.abs_lines) {
+        keep_range(l.line_low, l.line_up);
+        for (uint_t i : range(l.cont_low)) {
+            keep_range(l.cont_low[i], l.cont_up[i]);
+        }
+    }
+
+    for (auto& r : input.cont_ratios) {
+        keep_range(r.cont1_low, r.cont1_up);
+        keep_range(r.cont2_low, r.cont2_up);
+    }
+
+    return where(keep);
+}
+
+vec2d gridder_t::build_bolometric_correction(const vec1d& lam, const vec2d& seds,
+    const vec1u& keep, const vec2d& dust_law) const {
+
+    // For each SED of the library, compute the difference between the bolometric luminosity
+    // integrated over the full wavelength grid and over the selected wavelengths, without
+    // dust (first column) and for each value of Av (other columns). Since models are linear
+    // combinations of the SEDs of the library, so are these corrections.
+    uint_t nsed = seds.dims[0];
+    uint_t nav = dust_law.dims[0];
+
+    vec1d plam = lam[keep];
+    vec2d corr(nsed, 1+nav);
+    for (uint_t is : range(nsed)) {
+        vec1d sed = seds(is,_);
+        corr.safe(is,0) = integrate(lam, sed) - integrate(plam, sed[keep]);
+
+        for (uint_t id : range(nav)) {
+            vec1d att_sed = sed*dust_law(id,_);
+            corr.safe(is,1+id) = integrate(lam, att_sed) - integrate(plam, att_sed[keep]);
+        }
+    }
+
+    return corr;
+}
+
+vec2d gridder_t::build_bolometric_weights(const vec1d& lam, const vec1u& keep,
+    const vec2d& dust_law) const {
+
+    // Same as build_bolometric_correction(), but for any SED: the corrections are obtained
+    // from the dot product of the SED on the full wavelength grid with each row of the
+    // returned matrix (first row without dust, then one row for each value of Av).
+    // NB: these are the difference of the trapezoid weights of the full and selected grids.
+    uint_t nlam = lam.size();
+    uint_t nkeep = keep.size();
+    uint_t nav = dust_law.dims[0];
+
+    vec1d w(nlam);
+    for (uint_t il : range(nlam)) {
+        double l0 = lam.safe[il > 0 ? il-1 : il];
+        double l1 = lam.safe[il+1 < nlam ? il+1 : il];
+        w.safe[il] = 0.5*(l1 - l0);
+    }
+
+    for (uint_t k : range(nkeep)) {
+        double l0 = lam.safe[keep.safe[k > 0 ? k-1 : k]];
+        double l1 = lam.safe[keep.safe[k+1 < nkeep ? k+1 : k]];
+        w.safe[keep.safe[k]] -= 0.5*(l1 - l0);
+    }
+
+    vec2d weights(1+nav, nlam);
+    for (uint_t il : range(nlam)) {
+        weights.safe(0,il) = w.safe[il];
+        for (uint_t id : range(nav)) {
+            weights.safe(1+id,il) = w.safe[il]*dust_law.safe(id,il);
+        }
+    }
+
+    return weights;
+}
+
+gridder_t::generator_workspace_t::generator_workspace_t(uint_t nflux, uint_t nprop, uint_t nparam) {
+    m.model.flux.resize(nflux);
+    m.model.props.resize(nprop);
+    m.idm.resize(nparam);
 }
 
 void gridder_t::build_and_send_impl(fitter_t& fitter, progress_t& pg,
-    const vec1d& lam, const vec1d& tpl_flux, const vec2d& dust_law, const vec2d& igm_abs,
-    float lage, vec1u& idm, model_t& model) {
+    const vec1d& lam, const vec2d& dust_law, const filter_integrator_t& fint,
+    generator_workspace_t& ws) {
+
+    // NB: the SED of the model and its bolometric correction are in the workspace,
+    // and all temporaries are stored there too, to avoid allocations
+    const vec1d& tpl_flux = ws.tpl_flux;
+    const vec1d& bol_corr = ws.tpl_bol_corr;
+    vec1f& tpl_att_flux = ws.tpl_att_flux;
+    vec1d& cum = ws.cum;
+    vec1u& idm = ws.m.idm;
+    model_t& model = ws.m.model;
 
     vec1f& output_av = output.grid[grid_id::av];
     vec1f& output_z = output.grid[grid_id::z];
@@ -522,21 +922,42 @@ void gridder_t::build_and_send_impl(fitter_t& fitter, progress_t& pg,
     model_sscale = 1.0; // by definition
 
     // Pre-compute bolometric luminosity
-    double lbol = integrate(lam, tpl_flux);
-    model_lion = integrate(lam, tpl_flux, lam.front(), opts.lambda_ion);
+    // NB: all integrals are obtained from the cumulative integral of the SED
+    // NB: lam may not cover the whole SED, see build_wavelength_selection()
+    cumulative_integral(lam, tpl_flux, cum);
+    double lbol = (cum.empty() ? 0.0 : cum.back()) + bol_corr.safe[0];
+    model_lion = window_integral(fint.lion, cum, tpl_flux);
 
     for (uint_t id : range(output_av)) {
         idm[grid_id::av] = id;
 
+        if (!model_mask.empty()) {
+            // Skip this attenuation if none of its models are needed
+            ws.tidm = idm;
+            ws.tidm[grid_id::z] = npos;
+            if (!mask_has_any(ws.tidm)) {
+                skip_models(pg, output_z.size());
+                continue;
+            }
+        }
+
         // Apply dust reddening
-        vec1f tpl_att_flux = tpl_flux;
+        tpl_att_flux.resize(tpl_flux.size());
         if (output_av[id] > 0) {
             for (uint_t il : range(tpl_att_flux)) {
-                tpl_att_flux.safe[il] *= dust_law.safe(id,il);
+                tpl_att_flux.safe[il] = tpl_flux.safe[il]*dust_law.safe(id,il);
+            }
+        } else {
+            for (uint_t il : range(tpl_att_flux)) {
+                tpl_att_flux.safe[il] = tpl_flux.safe[il];
             }
+        }
 
+        cumulative_integral(lam, tpl_att_flux, cum);
+
+        if (output_av[id] > 0) {
             // Compute absorbed energy
-            double lobs = integrate(lam, tpl_att_flux);
+            double lobs = (cum.empty() ? 0.0 : cum.back()) + bol_corr.safe[1+id];
             model_ldust = lbol - lobs;
         } else {
             model_ldust = 0;
@@ -544,10 +965,7 @@ void gridder_t::build_and_send_impl(fitter_t& fitter, progress_t& pg,
 
         // Compute rest-frame luminosities
         for (uint_t i : range(opts.rest_mag)) {
-            model.props[output.ifirst_rlum+i] = rflum2fl*sqr(input.rf_lambda[i])*astro::sed2flux(
-                input.rf_filters.safe[i].wl, input.rf_filters.safe[i].tr,
-                lam, tpl_att_flux
-            );
+            model.props[output.ifirst_rlum+i] = fint.rest.integrate(i, tpl_att_flux);
 
             if (!is_finite(model.props[output.ifirst_rlum+i])) {
                 // Filter goes out of model coverage, assume zero
@@ -559,12 +977,12 @@ void gridder_t::build_and_send_impl(fitter_t& fitter, progress_t& pg,
         for (uint_t i : range(input.abs_lines)) {
             auto& l = input.abs_lines[i];
 
-            double fl = integrate(lam, tpl_att_flux, l.line_low, l.line_up);
+            double fl = window_integral(fint.abs_line.safe[i], cum, tpl_att_flux);
 
             double fc = 0.0;
             if (l.cont_low.size() == 1) {
                 // Single window, assume continuum is constant
-                fc = integrate(lam, tpl_att_flux, l.cont_low[0], l.cont_up[0])/
+                fc = window_integral(fint.abs_cont.safe(i,0), cum, tpl_att_flux)/
                     (l.cont_up[0] - l.cont_low[0]);
 
                 // Subtract continuum
@@ -574,9 +992,9 @@ void gridder_t::build_and_send_impl(fitter_t& fitter, progress_t& pg,
                 double l1 = 0.5*(l.cont_low[0] + l.cont_up[0]);
                 double l2 = 0.5*(l.cont_low[1] + l.cont_up[1]);
 
-                double f1 = integrate(lam, tpl_att_flux, l.cont_low[0], l.cont_up[0])/
+                double f1 = window_integral(fint.abs_cont.safe(i,0), cum, tpl_att_flux)/
                     (l.cont_up[0] - l.cont_low[0]);
-                double f2 = integrate(lam, tpl_att_flux, l.cont_low[1], l.cont_up[1])/
+                double f2 = window_integral(fint.abs_cont.safe(i,1), cum, tpl_att_flux)/
                     (l.cont_up[1] - l.cont_low[1]);
 
                 fc = interpolate(f1, f2, l1, l2, 0.5*(l.line_low + l.line_up));
@@ -594,38 +1012,40 @@ void gridder_t::build_and_send_impl(fitter_t& fitter, progress_t& pg,
         for (uint_t i : range(input.cont_ratios)) {
             auto& r = input.cont_ratios[i];
 
-            double fc1 = integrate(lam, tpl_att_flux, r.cont1_low, r.cont1_up)/
+            double fc1 = window_integral(fint.cont_ratio.safe(i,0), cum, tpl_att_flux)/
                 (r.cont1_up - r.cont1_low);
-            double fc2 = integrate(lam, tpl_att_flux, r.cont2_low, r.cont2_up)/
+            double fc2 = window_integral(fint.cont_ratio.safe(i,1), cum, tpl_att_flux)/
                 (r.cont2_up - r.cont2_low);
 
             model.props[output.ifirst_ratio+i] = fc2/fc1;
         }
 
         // Redshift, integrate, and send to fitter
-        for (uint_t iz : range(output_z)) {
+        for (uint_t jz : range(output_z)) {
+            // NB: the fitter may ask for a specific order, see fitter_t::model_zorder
+            uint_t iz = (fitter.model_zorder.empty() ? jz : fitter.model_zorder.safe[jz]);
             idm[grid_id::z] = iz;
             model.igrid = model_id(idm);
 
-            vec1f tpl_att_z_lam = lam;
-            vec1f tpl_att_z_flux = tpl_att_flux;
-
-            for (uint_t il : range(tpl_att_z_flux)) {
-                // Apply IGM absorption & redshift
-                if (opts.no_igm) {
-                    tpl_att_z_flux.safe[il] *= lum2fl.safe[iz];
-                } else {
-                    tpl_att_z_flux.safe[il] *= lum2fl.safe[iz]*igm_abs.safe(iz,il);
-                }
-                tpl_att_z_lam.safe[il] *= (1.0 + output_z.safe[iz]);
+            if (!model_mask.empty() && !model_mask.get(model.igrid)) {
+                // This model is not needed
+                skip_models(pg, 1);
+                continue;
             }
 
-            // Integrate
+            // Position of the model in the column cache, see CACHE_COLUMNS
+            const uint_t ipos = (columns.flux.empty() ? npos : model_valid.rank(model.igrid));
+
+            // Redshift, apply IGM absorption, and integrate (all included in the weights)
+            const filter_weights_t& fw = fint.obs.safe[iz];
             for (uint_t il : range(input.lambda)) {
-                model.flux.safe[il] = astro::sed2flux(
-                    input.filters.safe[il].wl, input.filters.safe[il].tr,
-                    tpl_att_z_lam, tpl_att_z_flux
-                );
+                if (columns.has_flux(il)) {
+                    // Already in the cache
+                    model.flux.safe[il] = columns.flux.safe[il].data[ipos];
+                    continue;
+                }
+
+                model.flux.safe[il] = fw.integrate(il, tpl_att_flux);
 
                 if (!is_finite(model.flux.safe[il])) {
                     // Filter goes out of model coverage, assume zero
@@ -633,37 +1053,21 @@ void gridder_t::build_and_send_impl(fitter_t& fitter, progress_t& pg,
                 }
             }
 
-            // See if we want to use this model or not
-            bool nofit = false;
-            if (!opts.no_max_age && lage > auniv[iz]) {
-                // Age greater than the age of the universe
-                nofit = true;
-            }
-
-            if (!nofit && !opts.grid_exclude.empty()) {
-                // Custom exclude function
-                auto lock = (opts.parallel == parallel_choice::generators ?
-                    std::unique_lock<std::mutex>(exclude_mutex) : std::unique_lock<std::mutex>());
-
-                for (uint_t i : range(nparam)) {
-                    exclude_expr.vars.safe[i] = output.grid.safe[i].safe[idm.safe[i]];
-                }
-
-                nofit = abs(exclude_expr.eval()) > 0;
-            }
-
             // Send to fitter
-            if (!nofit) {
-                fitter.fit(model);
-            }
+            // NB: models which cannot be fit are never built, see build_and_send_all()
+            fitter.fit(model);
 
-            // Cache and print progress
-            {
+            // Cache
+            // NB: the model is copied and written by the writer thread, no need to lock
+            cache.write_model(model);
+            columns.write_model(model, ipos);
+
+            // Print progress
+            if (opts.verbose) {
                 auto lock = (opts.parallel == parallel_choice::generators ?
                     std::unique_lock<std::mutex>(progress_mutex) : std::unique_lock<std::mutex>());
 
-                cache.write_model(model);
-                if (opts.verbose) progress_tick(pg, 0.5);
+                progress_tick(pg, 0.5);
             }
         }
     }
@@ -779,73 +1183,266 @@ void gridder_t::compute_sfh_quantities_impl(const vec1d& ltime, const vec1d& sfh
     }
 }
 
+void gridder_t::skip_models(progress_t& pg, uint_t n) {
+    if (!opts.verbose) return;
+
+    auto lock = (opts.parallel == parallel_choice::generators ?
+        std::unique_lock<std::mutex>(progress_mutex) : std::unique_lock<std::mutex>());
+
+    for (uint_t i = 0; i < n; ++i) {
+        progress_tick(pg, 0.5);
+    }
+}
+
+// Iterate over all grid points within [lo,hi] (inclusive), last axis first, as long as
+// 'func' returns true; returns false if the iteration was stopped
+template<typename F>
+bool foreach_grid_point_while(const vec1u& lo, const vec1u& hi, F&& func) {
+    vec1u idm = lo;
+    while (true) {
+        if (!func(idm)) return false;
+
+        uint_t a = idm.size();
+        while (a > 0) {
+            --a;
+            if (idm.safe[a] < hi.safe[a]) {
+                ++idm.safe[a];
+                break;
+            }
+
+            idm.safe[a] = lo.safe[a];
+            if (a == 0) return true;
+        }
+
+        if (idm.empty()) return true;
+    }
+}
+
+// Iterate over all grid points within [lo,hi] (inclusive), last axis first
+template<typename F>
+void foreach_grid_point(const vec1u& lo, const vec1u& hi, F&& func) {
+    foreach_grid_point_while(lo, hi, [&](const vec1u& idm) {
+        func(idm);
+        return true;
+    });
+}
+
+bool gridder_t::mask_has_any(const vec1u& idm) const {
+    if (model_mask.empty()) return true;
+
+    // Parameters that are not set are free
+    vec1u lo = idm, hi = idm;
+    for (uint_t a : range(grid_dims)) {
+        if (idm.safe[a] == npos) {
+            lo.safe[a] = 0;
+            hi.safe[a] = grid_dims.safe[a]-1;
+        }
+    }
+
+    // Stop at the first model which is needed
+    return !foreach_grid_point_while(lo, hi, [&](const vec1u& tidm) {
+        return !model_mask.get(model_id(tidm));
+    });
+}
+
 bool gridder_t::build_and_send(fitter_t& fitter) {
     if (opts.verbose) {
         note("start fitting...");
     }
 
-    if (read_from_cache) {
-        model_t model;
-        model.flux.resize(input.lambda.size());
-        model.props.resize(nprop);
-
-        auto pg = progress_start(nmodel);
-        for (uint_t m = 0; m < nmodel; ++m) {
-            if (cache.read_model(model)) {
-                bool nofit = false;
-                if (!opts.no_max_age) {
-                    vec1u idm = grid_ids(model.igrid);
-                    if (output.grid[grid_id::age][idm[grid_id::age]] > auniv[idm[grid_id::z]]) {
-                        nofit = true;
-                    }
-                }
+    if (opts.coarse_grid_step <= 1) {
+        return build_and_send_all(fitter);
+    }
 
-                if (!nofit && !opts.grid_exclude.empty()) {
-                    // Custom exclude function
-                    vec1u idm = grid_ids(model.igrid);
-                    for (uint_t i : range(nparam)) {
-                        exclude_expr.vars.safe[i] = output.grid.safe[i].safe[idm.safe[i]];
-                    }
+    // Coarse-to-fine search
+    // First fit a decimated grid, taking one every 'step' point along each axis (except
+    // metallicity), then fit the full resolution grid around the best models of each galaxy
+    const uint_t step = opts.coarse_grid_step;
 
-                    nofit = abs(exclude_expr.eval()) > 0;
-                }
+    auto is_coarse_index = [&](uint_t a, uint_t i) {
+        return i % step == 0 || i == grid_dims.safe[a]-1;
+    };
 
-                if (!nofit) {
-                    // Send to fitter
-                    fitter.fit(model);
-                }
+    // Some galaxies can only be fit within a narrow redshift range (e.g., zspec or FORCE_ZPHOT),
+    // or are only kept at their photo-z (BEST_AT_ZPHOT); if this range does not contain any
+    // point of the decimated redshift grid, it is fit at full resolution in the coarse pass
+    vec1b coarse_z(grid_dims.safe[grid_id::z]);
+    for (uint_t iz : range(coarse_z)) {
+        coarse_z.safe[iz] = is_coarse_index(grid_id::z, iz);
+    }
+
+    auto add_z_range = [&](uint_t zl, uint_t zu) {
+        for (uint_t iz = zl; iz <= zu; ++iz) {
+            if (is_coarse_index(grid_id::z, iz)) return;
+        }
+
+        for (uint_t iz = zl; iz <= zu; ++iz) {
+            coarse_z.safe[iz] = true;
+        }
+    };
 
-                if (opts.verbose) progress(pg, 131);
+    for (uint_t is : range(input.id)) {
+        if (opts.best_at_zphot && fitter.idz.safe[is] == npos && fitter.idzp.safe[is] != npos) {
+            add_z_range(fitter.idzp.safe[is], fitter.idzp.safe[is]);
+            if (opts.n_sim > 0) {
+                add_z_range(fitter.idzl.safe[is], fitter.idzu.safe[is]);
+            }
+        } else {
+            add_z_range(fitter.idzl.safe[is], fitter.idzu.safe[is]);
+        }
+    }
+
+    auto is_coarse = [&](const vec1u& idm) {
+        for (uint_t a : range(grid_dims)) {
+            if (a == grid_id::metal) continue;
+            if (a == grid_id::z) {
+                if (!coarse_z.safe[idm.safe[a]]) return false;
+            } else if (!is_coarse_index(a, idm.safe[a])) {
+                return false;
+            }
+        }
+
+        return true;
+    };
+
+    model_mask = bit_mask_t(nmodel, false);
+    vec1u lo = replicate(0u, grid_dims.size());
+    vec1u hi = grid_dims - 1;
+    foreach_grid_point(lo, hi, [&](const vec1u& idm) {
+        model_mask.set(model_id(idm), is_coarse(idm));
+    });
+
+    if (opts.verbose) {
+        note("fitting coarse grid (", model_mask.count(), " models)...");
+    }
+
+    fitter.start_coarse_pass();
+    if (!build_and_send_all(fitter)) {
+        return false;
+    }
+
+    vec1u seeds = fitter.end_coarse_pass();
+
+    // Now build the refined grid
+    model_mask.fill(false);
+    for (uint_t igrid : seeds) {
+        vec1u idm = grid_ids(igrid);
+        for (uint_t a : range(grid_dims)) {
+            if (a == grid_id::metal) {
+                lo.safe[a] = hi.safe[a] = idm.safe[a];
             } else {
-                print("");
-                error("could not read data from cache file");
-                error("the cache is probably corrupted, please remove it and try again");
-                print("");
+                lo.safe[a] = (idm.safe[a] >= step-1 ? idm.safe[a]-(step-1) : 0);
+                hi.safe[a] = min(idm.safe[a]+(step-1), grid_dims.safe[a]-1);
+            }
+        }
+
+        foreach_grid_point(lo, hi, [&](const vec1u& tidm) {
+            // Models of the coarse grid have already been fit
+            if (!is_coarse(tidm)) {
+                model_mask.set(model_id(tidm), true);
+            }
+        });
+    }
+
+    if (opts.verbose) {
+        note("refining grid around ", seeds.size(), " coarse minima (", model_mask.count(),
+            " models)...");
+    }
+
+    bool ret = build_and_send_all(fitter);
+    model_mask.clear();
+
+    if (ret && opts.verbose) {
+        note("evaluated ", uint_t(fitter.nfit_models), " models out of ", nmodel, " (",
+            100.0*fitter.nfit_models/double(nmodel), "%)");
+    }
+
+    return ret;
+}
+
+bool gridder_t::build_and_send_all(fitter_t& fitter) {
+    if (read_from_cache) {
+        if (opts.cache_columns) {
+            return read_and_send_columns(fitter);
+        } else {
+            return read_and_send_cache(fitter, nullptr);
+        }
+    }
+
+    // Models which are already in the cache need not be built again
+    bit_mask_t present;
+    if (write_cache && opts.cache_columns) {
+        // Only the missing columns are created, the others are read while building models
+        if (!columns.open_write()) {
+            warning("cache files could not be created");
+            warning("the program will not use the cache");
+        }
+
+        write_cache = false;
+    } else if (write_cache) {
+        if (cache.nblock > 0) {
+            // Resume building an incomplete cache: first fit the models it contains
+            present = bit_mask_t(nmodel, false);
+            if (!read_and_send_cache(fitter, &present)) {
                 return false;
             }
+
+            if (opts.verbose) {
+                note("resuming cache, ", present.count(), " models out of ", nmodel,
+                    " were already built");
+            }
         }
-    } else {
-        bool ret = false;
 
-        switch (opts.sfh) {
-        case sfh_type::gridded:
-            ret = build_and_send_ised(fitter);
-            break;
-        case sfh_type::custom:
-            ret = build_and_send_custom(fitter);
-            break;
-        default:
-            error("this SFH is not implemented yet");
-            break;
+        if (!cache.open_write(1024.0*1024.0*opts.cache_write_buffer, opts.cache_direct_io)) {
+            warning("cache file could not be created");
+            warning("the program will not use the cache");
+        } else if (opts.verbose) {
+            note("cache will be written in the background (buffer of ",
+                pretty_size(cache.write_memory()), ")");
         }
 
-        // Make sure we flush all the cache out
-        cache.cache_file.close();
+        // NB: the cache is only written once
+        write_cache = false;
+    }
 
-        return ret;
+    bool mask_was_empty = model_mask.empty();
+    if (!present.empty()) {
+        model_mask = present;
+        model_mask.invert();
     }
 
-    return true;
+    // Models which cannot be fit need not be built (they are not stored in the cache either)
+    if (nvalid < nmodel) {
+        if (model_mask.empty()) {
+            model_mask = model_valid;
+        } else {
+            model_mask &= model_valid;
+        }
+    }
+
+    bool ret = false;
+
+    switch (opts.sfh) {
+    case sfh_type::gridded:
+        ret = build_and_send_ised(fitter);
+        break;
+    case sfh_type::custom:
+        ret = build_and_send_custom(fitter);
+        break;
+    default:
+        error("this SFH is not implemented yet");
+        break;
+    }
+
+    if (mask_was_empty) {
+        model_mask.clear();
+    }
+
+    // Make sure we flush all the cache out
+    cache.close_write();
+    columns.close_write();
+
+    return ret;
 }
 
 bool gridder_t::build_template_impl(uint_t iflat, bool nodust,
@@ -884,28 +1481,29 @@ bool gridder_t::build_template_impl(uint_t iflat, bool nodust,
     }
 
     // Compute IGM absorption
-    vec2d igm_abs;
-    if (!opts.no_igm) {
-        igm_abs = build_igm_absorption({z}, lam);
+    vec1d scale;
+    if (opts.no_igm) {
+        scale = replicate(lum2fl[iz], lam.size());
+    } else {
+        scale = lum2fl[iz]*igm::madau1995(z, lam);
     }
 
-    for (uint_t il : range(flux)) {
-        // Apply IGM absorption & redshift
-        if (opts.no_igm) {
-            flux.safe[il] *= lum2fl[iz];
+    // Integrate, using the same weights as in build_and_send_impl()
+    filter_weights_t fw = build_filter_weights(input.filters, lam, z, scale);
+    iflux.resize(input.lambda.size());
+    for (uint_t il : range(input.lambda)) {
+        if (fw.offset.safe[il+1] == fw.offset.safe[il]) {
+            // Filter goes out of model coverage
+            iflux[il] = fnan;
         } else {
-            flux.safe[il] *= lum2fl[iz]*igm_abs.safe(0,il);
+            iflux[il] = fw.integrate(il, flux);
         }
-        lam.safe[il] *= (1.0 + z);
     }
 
-    // Integrate
-    iflux.resize(input.lambda.size());
-    for (uint_t il : range(input.lambda)) {
-        iflux[il] = astro::sed2flux(
-            input.filters[il].wl, input.filters[il].tr,
-            lam, flux
-        );
+    for (uint_t il : range(flux)) {
+        // Apply IGM absorption & redshift
+        flux.safe[il] *= scale.safe[il];
+        lam.safe[il] *= (1.0 + z);
     }
 
     return true;
@@ -1042,6 +1640,7 @@ bool gridder_t::write_seds() const {
     thread::worker_pool<sed_id_pair> pool;
     if (opts.n_thread > 1) {
         pool.start(opts.n_thread, write_sed);
+        pool.set_max_queued(opts.max_queued_fits);
     }
 
     std::ifstream in(opts.make_seds);
@@ -1074,11 +1673,6 @@ bool gridder_t::write_seds() const {
 
         if (opts.n_thread > 1) {
             // Parallel
-            while (opts.max_queued_fits > 0 &&
-                pool.remaining() > opts.max_queued_fits) {
-                thread::sleep_for(1e-6);
-            }
-
             pool.process({id, igrid, scale});
         } else {
             // Single threaded
@@ -1090,10 +1684,6 @@ bool gridder_t::write_seds() const {
     }
 
     if (opts.n_thread > 1) {
-        while (pool.remaining() != 0) {
-            thread::sleep_for(1e-6);
-        }
-
         pool.join();
     }
 
@@ -1117,12 +1707,16 @@ uint_t gridder_t::model_id(const vec1u& ids) const {
 }
 
 vec1u gridder_t::grid_ids(uint_t iflat) const {
-    vec1u idm(grid_dims_pitch.size());
+    vec1u idm;
+    grid_ids(iflat, idm);
+    return idm;
+}
+
+void gridder_t::grid_ids(uint_t iflat, vec1u& idm) const {
+    idm.resize(grid_dims_pitch.size());
     for (uint_t i : range(grid_dims)) {
         uint_t j = grid_dims.size()-1-i;
         idm.safe[j] = iflat % grid_dims.safe[j];
         iflat /= grid_dims.safe[j];
     }
-
-    return idm;
 }
@@ -1,5 +1,9 @@
 #include "fast++.hpp"
 
+#ifdef __linux__
+#include <sched.h>
+#endif
+
 extern const char* fastpp_version;
 
 std::string remove_first_last(std::string val, std::string charlist) {
@@ -25,6 +29,19 @@ bool parse_value_impl(const std::string& val, std::string& out) {
     return true;
 }
 
+uint_t count_available_cores() {
+#ifdef __linux__
+    // Only count the cores this process is allowed to run on
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        return CPU_COUNT(&set);
+    }
+#endif
+
+    return std::thread::hardware_concurrency();
+}
+
 bool parse_value_impl(std::string val, parallel_choice& out) {
     val = trim(to_lower(remove_first_last(val, "\'\"")));
     if (val == "none" || val.empty()) {
@@ -35,9 +52,33 @@ bool parse_value_impl(std::string val, parallel_choice& out) {
         out = parallel_choice::models;
     } else if (val == "generators") {
         out = parallel_choice::generators;
+    } else if (val == "simulations") {
+        out = parallel_choice::simulations;
+    } else if (val == "auto") {
+        out = parallel_choice::automatic;
     } else {
         error("unknown parallelization choice '", val, "'");
-        error("must be one of 'none', sources', 'models' or 'generators'");
+        error("must be one of 'none', sources', 'models', 'generators', 'simulations' or 'auto'");
+        return false;
+    }
+    return true;
+}
+
+bool parse_value_impl(std::string val, sfh_kind& out) {
+    val = trim(to_lower(remove_first_last(val, "\'\"")));
+    if (val == "expression" || val.empty()) {
+        out = sfh_kind::expression;
+    } else if (val == "exponential") {
+        out = sfh_kind::exponential;
+    } else if (val == "delayed") {
+        out = sfh_kind::delayed;
+    } else if (val == "truncated") {
+        out = sfh_kind::truncated;
+    } else if (val == "constant") {
+        out = sfh_kind::constant;
+    } else {
+        error("unknown custom SFH kind '", val, "'");
+        error("must be one of 'expression', 'exponential', 'delayed', 'truncated' or 'constant'");
         return false;
     }
     return true;
@@ -139,9 +180,20 @@ bool read_params(options_t& opts, input_state_t& state, const std::string& filen
         PARSE_OPTION(save_sim)
         PARSE_OPTION(best_from_sim)
         PARSE_OPTION(no_cache)
+        PARSE_OPTION(cache_mmap)
+        PARSE_OPTION(cache_huge_pages)
+        PARSE_OPTION(cache_write_buffer)
+        PARSE_OPTION(cache_direct_io)
+        PARSE_OPTION(cache_columns)
+        PARSE_OPTION(sed_cache)
         PARSE_OPTION(parallel)
         PARSE_OPTION(n_thread)
         PARSE_OPTION(max_queued_fits)
+        PARSE_OPTION(max_weight_store)
+        PARSE_OPTION(max_queue_memory)
+        PARSE_OPTION(prune_bands)
+        PARSE_OPTION(coarse_grid_step)
+        PARSE_OPTION(coarse_grid_nbest)
         PARSE_OPTION(verbose)
         PARSE_OPTION(debug)
         PARSE_OPTION(sfr_avg)
@@ -154,6 +206,9 @@ bool read_params(options_t& opts, input_state_t& state, const std::string& filen
         PARSE_OPTION(custom_sfh)
         PARSE_OPTION(custom_sfh_step)
         PARSE_OPTION(custom_sfh_lookback)
+        PARSE_OPTION(custom_sfh_adaptive)
+        PARSE_OPTION(custom_sfh_tol)
+        PARSE_OPTION(custom_sfh_kind)
         PARSE_OPTION(custom_params)
         PARSE_OPTION(grid_exclude)
         PARSE_OPTION(no_igm)
@@ -284,6 +339,11 @@ bool read_params(options_t& opts, input_state_t& state, const std::string& filen
     check_sfh_step(opts.sfh_output_step, "output");
     check_sfh_step(opts.custom_sfh_step, "custom");
 
+    if (opts.custom_sfh_tol <= 0 || !is_finite(opts.custom_sfh_tol)) {
+        error("CUSTOM_SFH_TOL must be strictly positive");
+        return false;
+    }
+
     if (opts.verbose) {
         if (opts.sfr_avg == 0) {
             note("using instantaneous SFRs");
@@ -321,6 +381,35 @@ bool read_params(options_t& opts, input_state_t& state, const std::string& filen
         return false;
     }
 
+    if (opts.custom_sfh_kind != sfh_kind::expression) {
+        if (opts.custom_sfh_kind != sfh_kind::constant &&
+            count(to_lower(opts.custom_params) == "log_tau") == 0) {
+            error("CUSTOM_SFH_KIND requires 'log_tau' to be listed in CUSTOM_PARAMS");
+            return false;
+        }
+
+        if (opts.custom_sfh.empty()) {
+            // Write the equivalent expression, which is still used for the outputs
+            std::string t = (opts.custom_sfh_lookback ? "(10^lage - t)" : "t");
+            switch (opts.custom_sfh_kind) {
+            case sfh_kind::exponential:
+                opts.custom_sfh = "exp(-"+t+"/10^log_tau)";
+                break;
+            case sfh_kind::delayed:
+                opts.custom_sfh = "("+t+"/10^log_tau)*exp(-"+t+"/10^log_tau)";
+                break;
+            case sfh_kind::truncated:
+                opts.custom_sfh = "step(10^log_tau - "+t+")";
+                break;
+            case sfh_kind::constant:
+                opts.custom_sfh = "1";
+                break;
+            case sfh_kind::expression:
+                break;
+            }
+        }
+    }
+
     if (!opts.my_sfh.empty()) {
         opts.sfh = sfh_type::single;
     } else if (!opts.custom_sfh.empty()) {
@@ -333,12 +422,30 @@ bool read_params(options_t& opts, input_state_t& state, const std::string& filen
         opts.auto_scale = false;
     }
 
-    if (opts.parallel != parallel_choice::none && opts.n_thread <= 1) {
+    if (opts.parallel == parallel_choice::automatic && opts.n_thread == 0) {
+        opts.n_thread = count_available_cores();
+        if (opts.verbose) {
+            note("parallel execution: found ", opts.n_thread, " available CPU cores");
+        }
+    }
+
+    if (opts.parallel == parallel_choice::automatic && opts.n_thread <= 1) {
+        if (opts.verbose) {
+            note("parallel execution: only one thread available, parallelization disabled");
+        }
+
+        opts.parallel = parallel_choice::none;
+    } else if (opts.parallel != parallel_choice::none && opts.n_thread <= 1) {
         warning("parallelization is enabled but the number of thread is set to zero");
         warning("parallelization will be disabled unless you set N_THREAD > 1");
         opts.parallel = parallel_choice::none;
     }
 
+    if (opts.parallel == parallel_choice::simulations && opts.n_sim == 0) {
+        warning("PARALLEL='simulations' requires N_SIM > 0, switching to 'models'");
+        opts.parallel = parallel_choice::models;
+    }
+
     if (opts.best_at_zphot && opts.force_zphot) {
         note("BEST_AT_ZPHOT=1 is automatically true if FORCE_ZPHOT=1, "
             "so you do not have to specify both");
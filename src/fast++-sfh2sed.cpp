@@ -134,13 +134,19 @@ int vif_main(int argc, char* argv[]) {
     }
 
     // Sum SSPs
-    vec1d tpl_flux(ssp.lambda.size());
-    double mstar = 0.0;
-    ssp.integrate(t, sfr, [&](uint_t it, double formed) {
-        tpl_flux += formed*ssp.sed.safe(it,_);
-        mstar += formed*ssp.mass.safe[it];
+    vec2d formed(1, ssp.age.size());
+    ssp.integrate(t, sfr, [&](uint_t it, double f) {
+        formed.safe(0,it) = f;
     });
 
+    vec2d seds;
+    vec1d mass;
+    ssp_sum(formed, ssp.sed, seds);
+    ssp_sum(formed, ssp.mass, mass);
+
+    vec1d tpl_flux = seds(0,_);
+    double mstar = mass[0];
+
     // Normalize, if asked
     if (unit_mass) {
         tpl_flux /= mstar;
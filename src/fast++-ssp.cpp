@@ -152,3 +152,46 @@ bool ssp_bc03::read(std::string filename, bool noflux) {
     }
 }
 
+void ssp_sum(const vec2d& w, const vec2d& m, vec2d& out) {
+    const uint_t nsfh = w.dims[0];
+    const uint_t nssp = w.dims[1];
+    const uint_t n = m.dims[1];
+
+    out.resize(nsfh, n);
+    std::fill(out.data.begin(), out.data.end(), 0.0);
+
+    // Process columns by blocks, so the corresponding block of 'm' stays in the cache while
+    // it is used for all the SFHs of the batch. The innermost loop is over contiguous memory,
+    // so it can be vectorized by the compiler.
+    const uint_t nblock = 256;
+    for (uint_t j0 = 0; j0 < n; j0 += nblock) {
+        const uint_t j1 = std::min(n, j0 + nblock);
+        for (uint_t i : range(nsfh)) {
+            double* po = &out.safe(i,0);
+            for (uint_t k : range(nssp)) {
+                const double wk = w.safe(i,k);
+                if (wk == 0.0) continue;
+
+                const double* pm = &m.safe(k,0);
+                for (uint_t j = j0; j < j1; ++j) {
+                    po[j] += wk*pm[j];
+                }
+            }
+        }
+    }
+}
+
+void ssp_sum(const vec2d& w, const vec1d& m, vec1d& out) {
+    const uint_t nsfh = w.dims[0];
+    const uint_t nssp = w.dims[1];
+
+    out.resize(nsfh);
+    for (uint_t i : range(nsfh)) {
+        double sum = 0.0;
+        for (uint_t k : range(nssp)) {
+            sum += w.safe(i,k)*m.safe[k];
+        }
+
+        out.safe[i] = sum;
+    }
+}
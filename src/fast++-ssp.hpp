@@ -20,7 +20,7 @@ struct ssp_bc03 {
     bool read(std::string filename, bool noflux = false);
 
     template<typename F>
-    void integrate(const vec1d& iage, const vec1d& isfr, F&& func) {
+    void integrate(const vec1d& iage, const vec1d& isfr, F&& func) const {
         double t2 = 0.0;
         uint_t ihint = npos;
         for (uint_t it : range(age)) {
@@ -45,6 +45,41 @@ struct ssp_bc03 {
             }
         }
     }
+
+    // Same as integrate(), for an SFH which can be integrated analytically: 'formed(t1,t2)'
+    // must return the mass formed between the lookback times t1 and t2, and 'tmax' is the
+    // lookback time of the onset of star formation.
+    template<typename I, typename F>
+    void integrate_analytic(double tmax, I&& formed, F&& func) const {
+        double t2 = 0.0;
+        for (uint_t it : range(age)) {
+            double t1 = t2;
+            if (it < age.size()-1) {
+                t2 = 0.5*(age.safe[it] + age.safe[it+1]);
+            } else {
+                t2 = age.back();
+            }
+
+            if (t2 <= 0.0) {
+                continue;
+            }
+
+            t1 = max(t1, 0.0);
+            t2 = min(t2, tmax);
+
+            func(it, formed(t1, t2));
+
+            if (t2 >= tmax) {
+                break;
+            }
+        }
+    }
 };
 
+// Weighted sums of SSP quantities for a batch of SFHs, computed as the matrix product w*m,
+// where 'w' [nsfh,nssp] is the mass formed in each SSP age bin, and 'm' [nssp,n] (or [nssp])
+// is the quantity to sum (e.g., the SEDs). The result 'out' is [nsfh,n] (or [nsfh]).
+void ssp_sum(const vec2d& w, const vec2d& m, vec2d& out);
+void ssp_sum(const vec2d& w, const vec1d& m, vec1d& out);
+
 #endif
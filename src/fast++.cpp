@@ -24,6 +24,96 @@ const constexpr uint_t log_style::decimal;
 const constexpr uint_t log_style::abmag;
 
 
+// Choose the parallel execution strategy and the queue depth for PARALLEL='auto'
+void choose_parallel_plan(options_t& opts, const input_state_t& input, const gridder_t& gridder,
+    const output_state_t& output) {
+
+    const uint_t ngal = input.id.size();
+    const uint_t nflux = input.lambda.size();
+    const uint_t nz = output.grid[grid_id::z].size();
+
+    // Galaxies with a spectroscopic redshift are only fit at one redshift
+    const uint_t nzspec = count(is_finite(input.zspec));
+    const double ngal_eff = (ngal - nzspec) + nzspec/double(nz);
+
+    // Rough number of operations needed to fit and to build each model
+    // NB: building a model from the library involves a few operations on each wavelength
+    // element of the template (a couple thousands for the usual libraries)
+    const double fit_cost = ngal_eff*(nflux + 1.0)*(3.0 + 2.0*opts.n_sim);
+    const double gen_cost = (gridder.read_from_cache ? 2.0*nflux : 2000.0*(nflux + 3.0));
+
+    // Memory used by the best fits copied in each thread, for 'models' and 'generators'
+    const double best_size = opts.n_thread*double(ngal)*
+        (3 + gridder.nprop + opts.n_sim*(2 + gridder.nprop))*sizeof(float);
+    const double budget = 1024.0*1024.0*opts.max_queue_memory;
+
+    std::string reason;
+    if (best_size > budget && ngal_eff >= opts.n_thread) {
+        opts.parallel = parallel_choice::sources;
+        reason = "the best fits of each thread would use "+pretty_size(best_size)+
+            " (more than MAX_QUEUE_MEMORY), so the catalog is split among threads instead";
+    } else if (gen_cost > fit_cost) {
+        if (gridder.read_from_cache && (opts.cache_mmap || opts.cache_columns)) {
+            opts.parallel = parallel_choice::generators;
+            reason = "fitting costs little and models are read from the memory-mapped cache, so "
+                "models are read and fit in parallel";
+        } else if (gridder.read_from_cache) {
+            opts.parallel = parallel_choice::models;
+            reason = "fitting costs little but models are read from the cache sequentially, so "
+                "models are fit in parallel";
+        } else {
+            opts.parallel = parallel_choice::generators;
+            reason = "building models costs more than fitting them, so models are built and "
+                "fit in parallel";
+        }
+    } else if (opts.n_sim >= 16*opts.n_thread && ngal_eff < 64.0*opts.n_thread) {
+        opts.parallel = parallel_choice::simulations;
+        reason = "fitting is dominated by the simulations and the catalog is too small to be "
+            "split among threads, so simulations are split instead";
+    } else if (ngal_eff >= 64.0*opts.n_thread) {
+        opts.parallel = parallel_choice::sources;
+        reason = "fitting dominates and the catalog is large enough to be split among threads";
+    } else {
+        opts.parallel = parallel_choice::models;
+        reason = "fitting dominates but the catalog is too small to be split among threads";
+    }
+
+    // Size the queue of models waiting to be fit from the memory budget,
+    // keeping enough models in the queue to feed all the threads
+    const double model_size = (nflux + gridder.nprop)*sizeof(float) + gridder.nparam*sizeof(uint_t) +
+        4*sizeof(vec1f);
+    double nqueue = budget/model_size;
+    nqueue = min(nqueue, double(gridder.nmodel));
+    nqueue = max(nqueue, 64.0*opts.n_thread);
+    opts.max_queued_fits = nqueue;
+
+    if (opts.verbose) {
+        std::string choice;
+        switch (opts.parallel) {
+            case parallel_choice::sources:     choice = "sources";     break;
+            case parallel_choice::models:      choice = "models";      break;
+            case parallel_choice::generators:  choice = "generators";  break;
+            case parallel_choice::simulations: choice = "simulations"; break;
+            default:                           choice = "none";        break;
+        }
+
+        note("parallel execution: using '", choice, "' with ", opts.n_thread, " threads");
+        note("  ", ngal, " galaxies (", uint_t(ceil(ngal_eff)), " effective), ", gridder.nmodel,
+            " models, ", nflux, " fluxes, ", opts.n_sim, " simulations, cache ",
+            (gridder.read_from_cache ? "available" : "not available"));
+        note("  ", reason);
+        if (opts.parallel != parallel_choice::generators) {
+            note("  at most ", opts.max_queued_fits, " models will be queued (",
+                pretty_size(opts.max_queued_fits*model_size), ")");
+        } else if (gridder.read_from_cache) {
+            note("  models are fit as soon as they are read, none will be queued");
+        } else {
+            note("  models are fit as soon as they are built, at most ", gridder.max_queued_libs,
+                " libraries will be queued");
+        }
+    }
+}
+
 int vif_main(int argc, char* argv[]) {
     std::string param_file = (argc >= 2 ? argv[1] : "fast.param");
 
@@ -42,8 +132,10 @@ int vif_main(int argc, char* argv[]) {
     }
 
     if (opts.make_seds.empty()) {
-        if (gridder.read_from_cache && opts.parallel == parallel_choice::generators &&
-            opts.n_thread > 0) {
+        if (opts.parallel == parallel_choice::automatic) {
+            choose_parallel_plan(opts, input, gridder, output);
+        } else if (gridder.read_from_cache && !opts.cache_mmap && !opts.cache_columns &&
+            opts.parallel == parallel_choice::generators && opts.n_thread > 0) {
             if (opts.verbose) {
                 note("using cache, switched parallel execution from 'generators' to 'models'");
             }
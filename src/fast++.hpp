@@ -12,6 +12,7 @@
 #include <vif/astro/astro.hpp>
 #include <vif/io/ascii.hpp>
 #include <iomanip>
+#include <future>
 #include "thread_worker_pool.hpp"
 #include "fast++-ssp.hpp"
 
@@ -24,13 +25,17 @@ extern const char* fastpp_version;
 // ------------------
 
 enum class parallel_choice {
-    none, sources, models, generators
+    none, sources, models, generators, simulations, automatic
 };
 
 enum class sfh_type {
     gridded, single, custom
 };
 
+enum class sfh_kind {
+    expression, exponential, delayed, truncated, constant
+};
+
 // Program options read from parameter file
 struct options_t {
     // Input catalog parameters
@@ -127,6 +132,9 @@ struct options_t {
     std::string custom_sfh;
     float       custom_sfh_step = 1.0;
     bool        custom_sfh_lookback = false;
+    bool        custom_sfh_adaptive = false;
+    float       custom_sfh_tol = 1e-3;
+    sfh_kind    custom_sfh_kind = sfh_kind::expression;
     vec1s       custom_params;
     vec1f       custom_params_min;
     vec1f       custom_params_max;
@@ -144,11 +152,26 @@ struct options_t {
 
     // Cache
     bool no_cache = false;
+    bool cache_mmap = true;
+    bool cache_huge_pages = false;
+    float cache_write_buffer = 64.0; // [MB]
+    bool cache_direct_io = false;
+    bool cache_columns = false;
+    bool sed_cache = false;
 
     // Multithreading
     parallel_choice parallel = parallel_choice::none;
     uint_t          n_thread = 0;
     uint_t          max_queued_fits = 1000;
+
+    // Memory usage
+    float max_weight_store = 1024.0; // [MB]
+    float max_queue_memory = 256.0;  // [MB]
+
+    // Fit speed-ups
+    uint_t prune_bands = 0;
+    uint_t coarse_grid_step = 0;
+    uint_t coarse_grid_nbest = 3;
 };
 
 // Filter passband
@@ -267,9 +290,6 @@ struct output_state_t {
     uint_t ifirst_abs   = npos;
     uint_t ifirst_ratio = npos;
     uint_t ifirst_sfhq  = npos;
-
-    // For thread safety
-    std::mutex fit_result_mutex;
 };
 
 // Structure holding the integrated fluxes of a model and associated physical parameters
@@ -279,12 +299,85 @@ struct model_t {
     uint_t igrid = npos;
 };
 
+// Read-only view of the fluxes and properties of a model stored elsewhere, e.g., in the
+// memory-mapped cache, so it can be fit without being copied
+struct model_view_t {
+    const float* flux = nullptr;     // [nfilt+nspec]
+    const float* props = nullptr;    // [nprop]
+    uint_t igrid = npos;
+
+    model_view_t() = default;
+    explicit model_view_t(const model_t& m) :
+        flux(m.flux.data.data()), props(m.props.data.data()), igrid(m.igrid) {}
+};
+
 // Structure holding a model and its associated grid ID
 struct model_id_pair {
     model_t model;
     vec1u idm;
 };
 
+// Number of bits set in a word
+inline uint_t bit_count(std::uint64_t w) {
+#ifdef __GNUC__
+    return __builtin_popcountll(w);
+#else
+    uint_t n = 0;
+    for (; w != 0; w &= w - 1) ++n;
+    return n;
+#endif
+}
+
+// Set of bits, one per model of the grid, stored in 64-bit words; the number of bits set
+// before a given position (its rank) is obtained from the count of each block of 8 words
+struct bit_mask_t {
+    vec<1,std::uint64_t> words;      // [nword]
+    vec<1,std::uint64_t> block_rank; // [nword/8+1] bits set before each block, see build_rank()
+    uint_t nbit = 0;
+
+    bit_mask_t() = default;
+    explicit bit_mask_t(uint_t n, bool value);
+
+    bool empty() const {
+        return nbit == 0;
+    }
+
+    uint_t size() const {
+        return nbit;
+    }
+
+    bool get(uint_t i) const {
+        return (words.safe[i/64] >> (i%64)) & 1u;
+    }
+
+    void set(uint_t i, bool value) {
+        std::uint64_t b = std::uint64_t(1) << (i%64);
+        if (value) {
+            words.safe[i/64] |= b;
+        } else {
+            words.safe[i/64] &= ~b;
+        }
+    }
+
+    // Number of bits set before position i, only valid after build_rank()
+    uint_t rank(uint_t i) const {
+        uint_t iw = i/64;
+        uint_t r = block_rank.safe[iw/8];
+        for (uint_t j = iw - iw%8; j < iw; ++j) {
+            r += bit_count(words.safe[j]);
+        }
+
+        return r + bit_count(words.safe[iw] & ((std::uint64_t(1) << (i%64)) - 1));
+    }
+
+    void fill(bool value);
+    void invert();
+    void clear();
+    uint_t count() const;
+    void build_rank();
+    bit_mask_t& operator&=(const bit_mask_t& m);
+};
+
 struct fitter_t;
 struct te_expr;
 struct te_variable;
@@ -303,27 +396,188 @@ struct gridder_t {
     const input_state_t& input;
     output_state_t& output;
 
+    // Cache of the model fluxes, see fast++-gridder-cache.cpp for the file format
     struct cache_manager_t {
         std::fstream cache_file;
         std::string cache_filename;
-
+        std::string grid_hash;
+        uint_t nmodel = 0, nflux = 0, nprop = 0; // NB: only the models that can be fit are stored
+        uint_t block_size = 0;       // number of models per block
+        uint_t nblock = 0;           // number of complete blocks in the file
+        bool complete = false;       // all models are in the file
+
+        // Read-only memory mapping of the cache file, to read models from several threads
+        const char* map_data = nullptr;
+        uint_t map_size = 0;
+
+        // Background writer, see CACHE_WRITE_BUFFER
+        struct writer_t;
+        std::unique_ptr<writer_t> writer;
+
+        void init(const std::string& filename, const std::string& hash, uint_t tnmodel,
+            uint_t tnflux, uint_t tnprop);
+        bool check(bool verbose);
+
+        uint_t record_size() const;
+        uint_t header_size() const;
+        uint_t block_offset(uint_t ib) const;
+        uint_t block_records(uint_t ib) const;
+        uint_t block_bytes(uint_t ib) const;
+        uint_t blocks_end(uint_t nb) const;
+        bool verify_block(uint_t ib, const char* data) const;
+
+        bool open_write(double buffer_size, bool direct);
+        bool writing() const;
+        uint_t write_memory() const;
+        void close_write();
         void write_model(const model_t& model);
-        bool read_model(model_t& model);
+
+        bool map(bool huge_pages);
+        void unmap();
+        ~cache_manager_t();
+    };
+
+    // Cache of the model fluxes with one file per flux channel, see CACHE_COLUMNS
+    struct column_cache_t {
+        struct column_t {
+            std::string filename;
+            std::string hash;         // hash of the grid and of the channel definition
+            uint_t nvalue = 1;        // number of values per model
+            float* data = nullptr;    // mapped values [nmodel,nvalue]
+            char* map_data = nullptr;
+            uint_t map_size = 0;
+            bool present = false;     // complete and valid, can be read
+            bool writable = false;    // being created
+        };
+
+        uint_t nmodel = 0;            // number of models stored (those that can be fit)
+        vec<1,column_t> flux;         // [nflux]
+        column_t props;
+        std::atomic<uint_t> nwritten; // number of models written in the new columns
+
+        void init(const std::string& prefix, const std::string& hash, uint_t tnmodel,
+            uint_t tnprop, const vec<1,fast_filter_t>& filters);
+        uint_t check(bool verbose);
+        bool complete() const;
+        bool has_flux(uint_t il) const;
+        bool open_write();
+        bool writing() const;
+        void write_model(const model_t& model, uint_t pos);
+        void close_write();
+        ~column_cache_t();
+    };
+
+    // Cache of the rest-frame SEDs of custom SFH models, before dust attenuation, one file
+    // per metallicity, see SED_CACHE
+    struct sed_cache_t {
+        std::string filename;
+        uint_t nrecord = 0;           // number of SEDs (one per custom parameter and age)
+        uint_t nlam = 0;              // number of wavelength elements
+        uint_t nvalue = 0;            // number of properties stored along with the SED
+        char* map_data = nullptr;
+        uint_t map_size = 0;
+
+        bool open(const std::string& fname, const std::string& hash, uint_t tnrecord,
+            uint_t tnlam, uint_t tnvalue);
+        uint_t record_size() const;
+        bool valid(uint_t ir) const;
+        void read(uint_t ir, vec1d& sed, vec1f& values) const;
+        void write(uint_t ir, const vec1d& sed, const vec1f& values);
+        ~sed_cache_t();
     };
 
     bool read_from_cache = true;
+    bool write_cache = false;
     cache_manager_t cache;
+    column_cache_t columns;
+
+    // Number of libraries whose models can be queued in the generator threads
+    // NB: queued models keep their library in memory
+    uint_t max_queued_libs = 2;
+
+    // Models to build and send to the fitter (all if empty), see COARSE_GRID_STEP
+    bit_mask_t model_mask;           // [nmodel]
+
+    // Models that can be fit (not older than the Universe, not excluded by GRID_EXCLUDE)
+    // NB: the rank of a model is its position among the models that can be fit
+    bit_mask_t model_valid;          // [nmodel]
+    uint_t nvalid = 0;
 
     struct tinyexpr_wrapper {
         te_expr* expr = nullptr;
         te_variable* vars_glue = nullptr;
         vec1d vars;
+        vec1d xbuf;                  // scratch array for values of the first variable
+
+        // Expression tree flattened to evaluate it for many values of the first variable
+        struct batch_program_t;
+        std::unique_ptr<batch_program_t> batch;
 
         bool compile(const std::string& sexpr, const vec1s& params);
         double eval();
+        void eval_batch(const vec1d& x, vec1d& res);
         ~tinyexpr_wrapper();
     };
 
+    // Sparse filter integration weights on a given wavelength grid [nfilt,nlam]:
+    // flux[i] = sum_k weight[offset[i]+k]*sed[first[i]+k], for k < offset[i+1]-offset[i].
+    // Filters which are not covered by the wavelength grid have no weight (zero flux).
+    struct filter_weights_t {
+        vec1u first;                 // [nfilt]
+        vec1u offset;                // [nfilt+1]
+        vec1d weight;                // [nnz]
+
+        double integrate(uint_t i, const vec1f& sed) const;
+    };
+
+    // Wavelength bound located on a given wavelength grid: lam[i] <= l <= lam[i+1]
+    struct lambda_bound_t {
+        uint_t i = 0;
+        double x = 0.0;                    // (l - lam[i])/(lam[i+1] - lam[i])
+        double dl = 0.0;                   // l - lam[i]
+    };
+
+    struct lambda_window_t {
+        lambda_bound_t lo, hi;
+    };
+
+    // Filter integration weights for all redshifts of the grid, and bounds of the integration
+    // windows for the model properties, built once per wavelength grid
+    struct filter_integrator_t {
+        vec1d lambda;                      // [nlam]
+        vec<1,filter_weights_t> obs;       // [nz] observed filters, including lum2fl & IGM
+        filter_weights_t rest;             // rest-frame filters, including rflum2fl*lambda^2
+
+        lambda_window_t lion;
+        vec<1,lambda_window_t> abs_line;   // [nabs]
+        vec<2,lambda_window_t> abs_cont;   // [nabs,2]
+        vec<2,lambda_window_t> cont_ratio; // [nratio,2]
+    };
+
+    // Scratch memory to build models, one per thread, re-used from one model to the next
+    struct generator_workspace_t {
+        model_id_pair m;
+        vec1u tidm;                        // [nparam]
+        vec1d tpl_flux;                    // [nlam]
+        vec1f tpl_att_flux;                // [nlam]
+        vec1d tpl_bol_corr;                // [1+nav]
+        vec1d cum;                         // [nlam]
+        vec1d ltime, sfh;                  // [ntime]
+        vec1d formed;                      // [nssp] mass formed in each SSP age bin
+        vec2d batch_formed;                // [nage,nssp]
+        vec2d batch_flux;                  // [nage,nlam]
+        vec2d batch_sums;                  // [nage,3+nav]
+        vec2f batch_props;                 // [nage,nprop]
+        vec1b batch_keep;                  // [nage]
+        vec1b batch_cached;                // [nage] SED read from the SED cache
+        vec1d sed_full;                    // [nlam_full] SED on the full wavelength grid
+        vec1f sed_values;                  // [3+nsfhq] properties stored in the SED cache
+        std::unique_ptr<tinyexpr_wrapper> sfh_expr;
+
+        generator_workspace_t() = default;
+        explicit generator_workspace_t(uint_t nflux, uint_t nprop, uint_t nparam);
+    };
+
     vec1u grid_dims;                 // [ngrid]
     vec1u grid_dims_pitch;           // [ngrid]
 
@@ -331,6 +585,7 @@ struct gridder_t {
     double rflum2fl;
     vec1d auniv;                     // [nz]
     uint_t nparam = 0, nprop = 0, nfreeparam = 0, nmodel = 0, ncustom = 0;
+    uint_t custom_tau_param = npos;  // position of 'log_tau' in CUSTOM_PARAMS
 
     // Caches
     mutable std::unique_ptr<ssp_bc03>     cached_ssp_bc03;
@@ -340,12 +595,11 @@ struct gridder_t {
     // For thread safety
     std::mutex progress_mutex;
     mutable std::mutex sfh_mutex;
-    mutable std::mutex exclude_mutex;
     mutable std::mutex sed_mutex;
 
     explicit gridder_t(const options_t& opts, const input_state_t& input, output_state_t& output);
 
-    bool check_options() const;
+    bool check_options();
 
     bool build_and_send(fitter_t& fitter);
     bool build_template(uint_t igrid, vec1f& lam, vec1f& flux, vec1f& iflux) const;
@@ -355,11 +609,20 @@ struct gridder_t {
 
     uint_t model_id(const vec1u& ids) const;
     vec1u grid_ids(uint_t iflat) const;
+    void grid_ids(uint_t iflat, vec1u& idm) const;
+    bool mask_has_any(const vec1u& idm) const;
 
 private :
+    void build_valid_mask();
+    void init_cache();
+    bool build_and_send_all(fitter_t& fitter);
+    bool read_and_send_cache(fitter_t& fitter, bit_mask_t* present);
+    bool read_and_send_columns(fitter_t& fitter);
+    void skip_models(progress_t& pg, uint_t n);
+
     void build_and_send_impl(fitter_t& fitter, progress_t& pg,
-        const vec1d& lam, const vec1d& tpl_flux, const vec2d& dust_law, const vec2d& igm_abs,
-        float lage, vec1u& idm, model_t& model);
+        const vec1d& lam, const vec2d& dust_law, const filter_integrator_t& fint,
+        generator_workspace_t& ws);
 
     void compute_sfh_quantities_impl(const vec1d& ltime, const vec1d& sfh, model_t& model);
 
@@ -378,10 +641,24 @@ private :
     std::string get_library_file_ssp(uint_t im) const;
 
     vec2d build_dust_law(const vec1f& av, const vec1f& lambda) const;
-    vec2d build_igm_absorption(const vec1f& z, const vec1f& lambda) const;
+    filter_weights_t build_filter_weights(const vec<1,fast_filter_t>& filters,
+        const vec1d& lambda, double z, const vec1d& scale) const;
+    void update_filter_integrator(const vec1d& lambda, filter_integrator_t& fint) const;
+    vec1u build_wavelength_selection(const vec1d& lambda) const;
+    vec2d build_bolometric_correction(const vec1d& lambda, const vec2d& seds,
+        const vec1u& keep, const vec2d& dust_law) const;
+    vec2d build_bolometric_weights(const vec1d& lambda, const vec1u& keep,
+        const vec2d& dust_law) const;
 
     bool get_age_bounds(const vec1f& ised_age, float nage, std::array<uint_t,2>& p, double& x) const;
+    bool compile_sfh_custom(tinyexpr_wrapper& expr) const;
+    bool check_sfh_closed_form() const;
+    double sfh_closed_form(const vec1u& idm, const ssp_bc03& ssp, vec1d& formed) const;
+    void sample_sfh_custom(tinyexpr_wrapper& expr, const vec1u& idm, const ssp_bc03& ssp,
+        vec1d& ltime, vec1d& sfh) const;
     void evaluate_sfh_custom(const vec1u& idm, const vec1d& t, vec1d& sfh) const;
+    void evaluate_sfh_custom(tinyexpr_wrapper& expr, const vec1u& idm, const vec1d& t,
+        vec1d& sfh) const;
 
     vec2d convolve_vdisp(const vec1d& lam, const vec2d& osed, double vdisp) const;
 
@@ -414,13 +691,21 @@ struct fitter_t {
     chi2_output_manager_t ochi2;
     best_chi2_output_manager_t obchi2;
 
+    // Models are sent to the fit kernel in batches, to re-use the galaxy data from the cache
+    // NB: batches are recycled once fit, so that models are copied in pre-allocated memory
+    struct model_batch {
+        vec<1,model_t> models;       // [batch_size]
+        vec<1,model_view_t> views;   // [batch_size] views of the above
+        uint_t size = 0;             // number of models in the batch
+    };
+
     struct model_source_pair {
-        model_t model;
-        uint_t i0 = 0, i1 = 0;
+        std::shared_ptr<const model_batch> models;
+        uint_t ipart = 0, npart = 1;
 
         model_source_pair() = default;
-        explicit model_source_pair(const model_t& m, uint_t ti0, uint_t ti1) :
-            model(m), i0(ti0), i1(ti1) {}
+        explicit model_source_pair(std::shared_ptr<const model_batch> m, uint_t tip, uint_t tnp) :
+            models(std::move(m)), ipart(tip), npart(tnp) {}
     };
 
     struct workers_multi_source_t {
@@ -428,15 +713,15 @@ struct fitter_t {
         thread::worker_pool<model_source_pair> workers;
 
         explicit workers_multi_source_t(fitter_t& f);
-        void process(const model_t& model);
+        void process(model_batch models);
     };
 
     struct workers_multi_model_t {
         fitter_t& fitter;
-        thread::worker_pool<model_t> workers;
+        thread::worker_pool<model_batch> workers;
 
         explicit workers_multi_model_t(fitter_t& f);
-        void process(const model_t& model);
+        void process(model_batch models);
     };
 
     std::unique_ptr<workers_multi_source_t> workers_multi_source;
@@ -445,19 +730,86 @@ struct fitter_t {
     vec2d tpl_err;               // [nz,nfilt+nspec]
     vec1u idz, idzp, idzl, idzu; // [ngal]
     vec1b has_spec;              // [ngal]
+
+    // Redshift index: galaxies sorted by their allowed redshift interval, so that all the
+    // galaxies that can be fit at a given redshift form a few contiguous runs
+    vec1u gorder;                // [ngal] galaxy id of each position
+    vec<1,vec1u> zrun_begin;     // [nz][nrun] first position of each run
+    vec<1,vec1u> zrun_end;       // [nz][nrun] last position (exclusive) of each run
     vec2d sim_rnd;               // [nsim,nfilt]
     vec1f best_chi2;             // [ngal]
     vec1s chi2_filename;         // [ngal]
 
+    // Pre-computed weights and weighted fluxes of each galaxy, which do not depend on the model
+    // NB: only depends on redshift if a template error function is used, otherwise nzs=1
+    // NB: galaxies are stored in the order of the redshift index, see 'gorder'
+    struct weight_store_t {
+        vec3d weight;            // [nzs,nflux,ngal]
+        vec3d wflux;             // [nzs,nflux,ngal]
+        vec2d wff, swff;         // [nzs,ngal]
+        vec3d rff, srff;         // [nzs,ngal,nsim] sum(rflux^2) of each simulation
+        bool zdep = false;
+        bool sims = false;       // rff and srff are available, see MAX_WEIGHT_STORE
+    };
+
+    bool use_wstore = false;
+    weight_store_t wstore;
+
+    // Best fits found by each worker thread, merged at the end of the fit
+    // NB: when the workers share the galaxies (or with a single thread), there is only one
+    struct best_fit_state_t {
+        vec1f chi2;              // [ngal]
+        vec1u model;             // [ngal]
+        vec2f props;             // [ngal,nprop]
+        vec1u num_models;        // [ngal]
+        vec2f mc_chi2;           // [ngal,nsim]
+        vec2u mc_model;          // [ngal,nsim]
+        vec3f mc_props;          // [ngal,nprop,nsim]
+        vec2f top_chi2;          // [ngal,ntop] for the coarse grid
+        vec2u top_model;         // [ngal,ntop] for the coarse grid
+    };
+
+    vec<1,best_fit_state_t> best_fits; // [nslot]
+
+    // Fit workspace of each thread, see fit_galaxies()
+    struct workspace_t;
+    std::vector<std::unique_ptr<workspace_t>> workspaces; // [nslot]
+
+    // Screening of models: the chi2 on a subset of the bands of each galaxy is a lower bound
+    // of the full chi2, if it is already larger than the best chi2 the model can be skipped
+    bool use_pruning = false;
+    float prune_tol = 0.0;       // chi2 tolerance above the best fit
+    vec2u prune_ids;             // [ngal,nprune] bands of the subset (npos if none)
+    vec1u model_zorder;          // [nz] order in which redshifts should be generated
+
+    // Coarse-to-fine search, see gridder_t::build_and_send()
+    bool coarse_pass = false;
+    std::atomic<uint_t> nfit_models; // number of models sent to the fitter
+
+    uint_t batch_size = 1;       // number of models fit together
+    uint_t tile_size = 1;        // number of galaxies fit together
+    model_batch pending_models;
+    std::vector<model_batch> free_batches;
+    std::mutex batch_mutex;
+
     explicit fitter_t(const options_t& opts, const input_state_t& input, const gridder_t& gridder,
         output_state_t& output);
+    ~fitter_t();
 
     void fit(const model_t& model);
+    void fit(const model_view_t& model);
+    void fit(const model_view_t* models, uint_t nm);
+    void start_coarse_pass();
+    vec1u end_coarse_pass();
     void find_best_fits();
 
 private :
-    inline void write_chi2(uint_t igrid, const vec1f& chi2, const vec2f& props, uint_t i0);
-    inline void fit_galaxies(const model_t& model, uint_t i0, uint_t i1);
+    inline void write_chi2(uint_t igrid, const vec1u& ids, const vec1f& chi2, const vec2f& props,
+        uint_t n);
+    model_batch get_batch();
+    void recycle_batch(model_batch&& models);
+    void fit_batch(model_batch models);
+    inline void fit_galaxies(const model_view_t* models, uint_t nm, uint_t ipart, uint_t npart);
 };
 
 // Main functions
@@ -474,6 +826,22 @@ void write_output(const options_t& opts, const input_state_t& state, const gridd
 // Helper functions
 // ----------------
 
+// Format a size in bytes for display
+inline std::string pretty_size(double size) {
+    std::string unit = "B";
+    vec1s units = vec1s{"k", "M", "G", "T", "P"}+"B";
+    for (uint_t i : range(units)) {
+        if (size > 1024) {
+            size /= 1024;
+            unit = units[i];
+        } else {
+            break;
+        }
+    }
+
+    return to_string(size)+" "+unit;
+}
+
 namespace vif {
 namespace file {
     template<typename S, typename T>
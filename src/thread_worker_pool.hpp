@@ -1,84 +1,85 @@
+#include <deque>
+#include <condition_variable>
+
 namespace vif {
 namespace thread {
-    template<typename W, typename T>
-    struct worker_with_workspace {
-        lock_free_queue<T> input;
-        W                  wsp;
-        std::atomic<bool>  shutdown;
-        std::thread        impl;
-
-        template<typename F, typename ... Args>
-        explicit worker_with_workspace(const F& f, const Args&... args) : wsp(args...),
-            shutdown(false), impl([this,f]() {
+    // Index of the worker running the current thread in its pool (0 for the main thread)
+    inline uint_t& this_worker_id() {
+        static thread_local uint_t id = 0;
+        return id;
+    }
 
-            T t;
-            while (!shutdown) {
-                while (input.pop(t)) {
-                    f(wsp, t);
-                }
-            }
-        }) {}
+    namespace worker_pool_impl {
+        // Call the user function with or without workspace
+        template<typename W>
+        struct worker_workspace {
+            W wsp;
 
-        ~worker_with_workspace() {
-            join();
-        }
+            template<typename ... Args>
+            explicit worker_workspace(const Args&... args) : wsp(args...) {}
 
-        void join() {
-            if (impl.joinable()) {
-                impl.join();
+            template<typename F, typename T>
+            void call(const F& f, T& t) {
+                f(wsp, t);
             }
-        }
+        };
 
-        uint_t workload() const {
-            return input.size();
-        }
-    };
+        template<>
+        struct worker_workspace<void> {
+            template<typename F, typename T>
+            void call(const F& f, T& t) {
+                f(t);
+            }
+        };
+    }
 
-    template<typename T>
-    struct worker_no_workspace {
-        lock_free_queue<T> input;
-        std::atomic<bool>  shutdown;
-        std::thread        impl;
+    // Pool of worker threads processing a stream of tasks.
+    // Each worker has its own queue of tasks; idle workers steal tasks from the queues of
+    // other workers, except for tasks that were pinned to a given worker with process(i,t).
+    // Idle workers sleep until new tasks are available, and producers are blocked when
+    // the number of queued tasks reaches the limit set with set_max_queued().
+    template<typename T, typename W = void>
+    struct worker_pool {
+        struct worker {
+            std::mutex                  queue_mutex;
+            std::deque<T>               pinned;  // tasks for this worker only
+            std::deque<T>               shared;  // tasks that can be stolen
+            std::atomic<uint_t>         npinned;
+            std::atomic<uint_t>         nshared;
+            worker_pool_impl::worker_workspace<W> wsp;
+            std::thread                 impl;
 
-        template<typename F>
-        explicit worker_no_workspace(const F& f) : shutdown(false),
-            impl([this,f]() {
+            template<typename ... Args>
+            explicit worker(const Args&... args) : npinned(0), nshared(0), wsp(args...) {}
 
-            T t;
-            while (!shutdown) {
-                while (input.pop(t)) {
-                    f(t);
+            void join() {
+                if (impl.joinable()) {
+                    impl.join();
                 }
             }
-        }) {}
-
-        ~worker_no_workspace() {
-            join();
-        }
 
-        void join() {
-            if (impl.joinable()) {
-                impl.join();
+            uint_t workload() const {
+                return npinned + nshared;
             }
-        }
-
-        uint_t workload() const {
-            return input.size();
-        }
-    };
-
-    template<typename T, typename W = void>
-    struct worker_pool {
-        using worker = typename std::conditional<std::is_same<W, void>::value,
-            worker_no_workspace<T>, worker_with_workspace<W,T>>::type;
+        };
 
         std::vector<std::unique_ptr<worker>> workers;
         uint_t last_push = 0;
+        uint_t max_queued = 0;
+
+        std::mutex              park_mutex;
+        std::condition_variable work_cv;   // signals new tasks to idle workers
+        std::condition_variable space_cv;  // signals free space in the queues to producers
+        std::condition_variable idle_cv;   // signals that all tasks are done
+        std::atomic<uint_t>     nqueued;   // tasks waiting in the queues
+        std::atomic<uint_t>     nleft;     // tasks waiting or being processed
+        bool                    shutdown = false;
 
-        worker_pool() = default;
+        worker_pool() : nqueued(0), nleft(0) {}
 
         template<typename F, typename ... Args>
-        explicit worker_pool(uint_t nthread, const F& f, const Args&... args) {
+        explicit worker_pool(uint_t nthread, const F& f, const Args&... args) :
+            nqueued(0), nleft(0) {
             start(nthread, f, args...);
         }
 
@@ -88,51 +89,97 @@ namespace thread {
 
         template<typename F, typename ... Args>
         void start(uint_t nthread, const F& f, const Args&... args) {
+            join();
+
+            shutdown = false;
             workers.clear();
             workers.reserve(nthread);
             for (uint_t i = 0; i < nthread; ++i) {
-                workers.emplace_back(new worker(f, args...));
+                workers.emplace_back(new worker(args...));
+            }
+
+            // Start the threads only once all workers exist, since they can steal from each other
+            for (uint_t i = 0; i < nthread; ++i) {
+                workers[i]->impl = std::thread([this,i,f]() {
+                    this_worker_id() = i;
+                    work(i, f);
+                });
             }
 
             last_push = workers.size()-1;
         }
 
+        // Limit the number of queued tasks (0: no limit)
+        void set_max_queued(uint_t n) {
+            max_queued = n;
+        }
+
+        // Wait for all tasks to be processed, then stop the threads
         void join() {
-            for (uint_t i : range(workers)) {
-                workers[i]->shutdown = true;
+            {
+                std::unique_lock<std::mutex> lock(park_mutex);
+                shutdown = true;
             }
 
+            work_cv.notify_all();
+
             for (uint_t i : range(workers)) {
                 workers[i]->join();
             }
         }
 
+        // Send a task to the least busy worker, which may be stolen by other workers
         void process(T t) {
+            wait_for_space();
+
             ++last_push;
             if (last_push >= workers.size()) {
                 last_push = 0;
             }
 
-            workers[last_push]->input.push(std::move(t));
+            uint_t iw = last_push;
+            for (uint_t i : range(workers)) {
+                if (workers[i]->workload() < workers[iw]->workload()) {
+                    iw = i;
+                }
+            }
+
+            // NB: count the task before it can be picked by a worker
+            ++nqueued;
+            ++nleft;
+
+            worker& w = *workers[iw];
+            {
+                std::unique_lock<std::mutex> lock(w.queue_mutex);
+                w.shared.push_back(std::move(t));
+                ++w.nshared;
+            }
+
+            notify_push(false);
         }
 
+        // Send a task to the i-th worker, it will not be stolen by other workers
         void process(uint_t i, T t) {
-            workers[i]->input.push(std::move(t));
-        }
+            wait_for_space();
 
-        void consume_all() {
-            bool finished = false;
-            while (!finished) {
-                finished = true;
-                for (uint_t i : range(workers)) {
-                    if (workers[i]->workload() > 0) {
-                        finished = false;
-                        break;
-                    }
-                }
+            // NB: count the task before it can be picked by a worker
+            ++nqueued;
+            ++nleft;
 
-                sleep_for(1e-6);
+            worker& w = *workers[i];
+            {
+                std::unique_lock<std::mutex> lock(w.queue_mutex);
+                w.pinned.push_back(std::move(t));
+                ++w.npinned;
             }
+
+            notify_push(true);
+        }
+
+        // Wait for all tasks to be processed, the threads keep running
+        void consume_all() {
+            std::unique_lock<std::mutex> lock(park_mutex);
+            idle_cv.wait(lock, [this]() { return nleft == 0; });
         }
 
         uint_t size() const {
@@ -140,12 +187,106 @@ namespace thread {
         }
 
         uint_t remaining() const {
-            uint_t nleft = 0;
-            for (uint_t i : range(workers)) {
-                nleft += workers[i]->workload();
+            return nleft;
+        }
+
+    private :
+        void wait_for_space() {
+            if (max_queued == 0 || nqueued < max_queued) return;
+
+            std::unique_lock<std::mutex> lock(park_mutex);
+            space_cv.wait(lock, [this]() { return nqueued < max_queued; });
+        }
+
+        void notify_push(bool pinned) {
+            // Lock to make sure a worker cannot miss the notification while going to sleep
+            { std::unique_lock<std::mutex> lock(park_mutex); }
+            if (pinned) {
+                // Only one worker can process this task, make sure it wakes up
+                work_cv.notify_all();
+            } else {
+                work_cv.notify_one();
+            }
+        }
+
+        bool has_work(uint_t i) const {
+            if (workers[i]->npinned > 0) return true;
+            for (uint_t j : range(workers)) {
+                if (workers[j]->nshared > 0) return true;
             }
 
-            return nleft;
+            return false;
+        }
+
+        bool pop_pinned(worker& w, T& t) {
+            if (w.npinned == 0) return false;
+
+            std::unique_lock<std::mutex> lock(w.queue_mutex);
+            if (w.pinned.empty()) return false;
+
+            t = std::move(w.pinned.front());
+            w.pinned.pop_front();
+            --w.npinned;
+            return true;
+        }
+
+        bool pop_shared(worker& w, T& t) {
+            if (w.nshared == 0) return false;
+
+            std::unique_lock<std::mutex> lock(w.queue_mutex);
+            if (w.shared.empty()) return false;
+
+            t = std::move(w.shared.front());
+            w.shared.pop_front();
+            --w.nshared;
+            return true;
+        }
+
+        bool pop(uint_t i, T& t) {
+            // First own tasks
+            if (pop_pinned(*workers[i], t) || pop_shared(*workers[i], t)) {
+                return true;
+            }
+
+            // Then steal from other workers
+            for (uint_t k = 1; k < workers.size(); ++k) {
+                if (pop_shared(*workers[(i+k) % workers.size()], t)) {
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        template<typename F>
+        void work(uint_t i, const F& f) {
+            worker& w = *workers[i];
+
+            T t;
+            while (true) {
+                if (pop(i, t)) {
+                    uint_t prev = nqueued--;
+                    if (max_queued > 0 && prev >= max_queued) {
+                        { std::unique_lock<std::mutex> lock(park_mutex); }
+                        space_cv.notify_all();
+                    }
+
+                    w.wsp.call(f, t);
+                    t = T();
+
+                    if (--nleft == 0) {
+                        { std::unique_lock<std::mutex> lock(park_mutex); }
+                        idle_cv.notify_all();
+                    }
+
+                    continue;
+                }
+
+                // Nothing to do, sleep until new tasks arrive
+                std::unique_lock<std::mutex> lock(park_mutex);
+                work_cv.wait(lock, [&]() { return shutdown || has_work(i); });
+                if (shutdown && !has_work(i)) break;
+            }
         }
     };
 }
@@ -0,0 +1,33 @@
+# Build a small model cache, then check that the next run finds it complete and reads it
+# as is. The grid only has a few models, so the cache has a single, short block.
+#
+# Usage: cmake -DFASTPP=... -DSHARE_DIR=... -DEXAMPLE_DIR=... -DWORK_DIR=... -P cache-reopen.cmake
+
+include(${CMAKE_CURRENT_LIST_DIR}/common.cmake)
+
+# Tiny grid and no simulation
+fastpp_setup_example(${WORK_DIR}
+    "VERBOSE=1" "PARALLEL=none" "N_SIM=0" "NO_CACHE=0"
+    "LOG_TAU_MIN=9.0" "LOG_TAU_MAX=9.0" "LOG_AGE_MIN=8.6" "LOG_AGE_MAX=9.0"
+    "Z_MIN=1.0" "Z_MAX=1.1" "A_V_MIN=0.0" "A_V_MAX=0.2")
+
+# First run: build the cache
+fastpp_run(${WORK_DIR} log)
+file(GLOB cache_files ${WORK_DIR}/bc03_*.grid)
+list(LENGTH cache_files ncache)
+if (NOT ncache EQUAL 1)
+    message(FATAL_ERROR "expected one cache file, found: ${cache_files}\n${log}")
+endif()
+
+file(SHA1 ${cache_files} cache_hash)
+
+# Second run: the cache must be read, not resumed nor rebuilt
+fastpp_run(${WORK_DIR} log)
+if (NOT log MATCHES "cache file exists and seems valid" OR log MATCHES "incomplete")
+    message(FATAL_ERROR "cache was not reopened as complete:\n${log}")
+endif()
+
+file(SHA1 ${cache_files} new_cache_hash)
+if (NOT new_cache_hash STREQUAL cache_hash)
+    message(FATAL_ERROR "cache file was modified by the second run")
+endif()
@@ -0,0 +1,43 @@
+# Fit the example catalog with the full grid, then with the coarse-to-fine search
+# (COARSE_GRID_STEP), and check that the best fits and confidence intervals are the same.
+#
+# Usage: cmake -DFASTPP=... -DSHARE_DIR=... -DEXAMPLE_DIR=... -DWORK_DIR=... -P coarse-grid.cmake
+
+include(${CMAKE_CURRENT_LIST_DIR}/common.cmake)
+
+set(common_options "PARALLEL=none" "NO_CACHE=1" "N_SIM=100" "C_INTERVAL=68")
+
+fastpp_setup_example(${WORK_DIR}/full ${common_options} "COARSE_GRID_STEP=0")
+fastpp_run(${WORK_DIR}/full log)
+
+fastpp_setup_example(${WORK_DIR}/coarse ${common_options}
+    "COARSE_GRID_STEP=2" "COARSE_GRID_NBEST=3")
+fastpp_run(${WORK_DIR}/coarse log)
+
+# Compare the results of each source, ignoring the header
+# NB: models are fit with the same arithmetic in both cases, so values must be identical
+file(STRINGS ${WORK_DIR}/full/hdfn_fs99.fout full_lines REGEX "^[^#]")
+file(STRINGS ${WORK_DIR}/coarse/hdfn_fs99.fout coarse_lines REGEX "^[^#]")
+
+list(LENGTH full_lines nfull)
+list(LENGTH coarse_lines ncoarse)
+if (NOT nfull EQUAL ncoarse OR nfull EQUAL 0)
+    message(FATAL_ERROR "expected ${nfull} sources, found ${ncoarse}")
+endif()
+
+file(STRINGS ${WORK_DIR}/full/hdfn_fs99.fout header REGEX "^# +id ")
+
+set(ndiff 0)
+math(EXPR last "${nfull} - 1")
+foreach(i RANGE ${last})
+    list(GET full_lines ${i} full)
+    list(GET coarse_lines ${i} coarse)
+    if (NOT full STREQUAL coarse)
+        message("difference for source ${i}:\n${header}\n  ${full}\n  ${coarse}")
+        math(EXPR ndiff "${ndiff} + 1")
+    endif()
+endforeach()
+
+if (ndiff GREATER 0)
+    message(FATAL_ERROR "${ndiff} sources out of ${nfull} differ with COARSE_GRID_STEP")
+endif()
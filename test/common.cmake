@@ -0,0 +1,46 @@
+# Helpers to run FAST++ on the example catalog in a test directory
+# Expects FASTPP, SHARE_DIR and EXAMPLE_DIR to be defined.
+
+# Create a fresh directory with the example catalog and a copy of the example parameter file,
+# where the options are given as NAME=VALUE
+function(fastpp_setup_example dir)
+    file(REMOVE_RECURSE ${dir})
+    file(MAKE_DIRECTORY ${dir})
+
+    foreach(ext cat translate zout)
+        configure_file(${EXAMPLE_DIR}/hdfn_fs99.${ext} ${dir}/hdfn_fs99.${ext} COPYONLY)
+    endforeach()
+
+    file(READ ${EXAMPLE_DIR}/fast.param params)
+    foreach(opt
+        "FILTERS_RES=${SHARE_DIR}/FILTER.RES.latest"
+        "TEMP_ERR_FILE=${SHARE_DIR}/TEMPLATE_ERROR.fast.v0.2"
+        "LIBRARY_DIR=${SHARE_DIR}/libraries/"
+        ${ARGN})
+
+        string(REGEX MATCH "^[^=]+" name "${opt}")
+        string(REGEX REPLACE "^[^=]+=" "" value "${opt}")
+        if (NOT value MATCHES "^[0-9.]+$")
+            set(value "'${value}'")
+        endif()
+
+        string(REGEX REPLACE "\n${name} *=[^\n]*" "\n${name} = ${value}" params "${params}")
+    endforeach()
+
+    file(WRITE ${dir}/fast.param "${params}")
+endfunction()
+
+# Run FAST++ in a test directory, and return its log
+function(fastpp_run dir output)
+    execute_process(COMMAND ${FASTPP} fast.param
+        WORKING_DIRECTORY ${dir}
+        RESULT_VARIABLE result
+        OUTPUT_VARIABLE log
+        ERROR_VARIABLE log)
+
+    if (NOT result EQUAL 0)
+        message(FATAL_ERROR "fast++ failed:\n${log}")
+    endif()
+
+    set(${output} "${log}" PARENT_SCOPE)
+endfunction()